@@ -42,6 +42,7 @@
 
 /* client functions */
 void cli_load_agent_keys(m_list * ret_list);
+void cli_agent_prefetch_keys(void);
 void agent_buf_sign(buffer *sigblob, sign_key *key, 
 		const buffer *data_buf, enum signature_type type);
 void cli_setup_agent(const struct Channel *channel);
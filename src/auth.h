@@ -74,7 +74,7 @@ void cli_get_user(void);
 void cli_auth_getmethods(void);
 int cli_auth_try(void);
 void recv_msg_userauth_banner(void);
-void cli_pubkeyfail(void);
+int cli_pubkeyfail(void);
 void cli_auth_password(void);
 int cli_auth_pubkey(void);
 void cli_auth_interactive(void);
@@ -129,6 +129,8 @@ struct AuthState {
 	char *pw_shell;
 	char *pw_name;
 	char *pw_passwd;
+	gid_t *pw_groups; /* supplementary groups, NULL if not looked up */
+	unsigned int pw_ngroups;
 #if DROPBEAR_SVR_PUBKEY_OPTIONS_BUILT
 	struct PubKeyOptions* pubkey_options;
 	char *pubkey_info;
@@ -58,6 +58,9 @@ struct Channel {
 			file descriptor (bidirectional), such as a network sockets.
 			That is handled differently when closing FDs. Is only
 			applicable to sockets (which can be used with shutdown()) */
+	int exitfd; /* becomes readable when the process behind the channel exits,
+				   such as a pidfd. -1 if unused. channelio() resets it to -1
+				   once it fires, the owner of the descriptor closes it */
 	circbuffer *writebuf; /* data from the wire, for local consumption. Can be
 							 initially NULL */
 	circbuffer *extrabuf; /* extended-data for the program - used like writebuf
@@ -78,12 +81,18 @@ struct Channel {
 					   for this channel (and are awaiting a confirmation
 					   or failure). */
 
+	int write_deferred; /* received data was queued in writebuf/extrabuf
+						   for channelio() to write */
+
 	/* Used by client chansession to handle ~ escaping, NULL ignored otherwise */
 	void (*read_mangler)(const struct Channel*, const unsigned char* bytes, int *len);
 
 	const struct ChanType* type;
 
 	enum dropbear_prio prio;
+
+	/* ses.chanfirst list */
+	struct Channel *chan_next, *chan_prev;
 };
 
 struct ChanType {
@@ -130,6 +139,9 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 #if DROPBEAR_CLIENT
 extern const struct ChanType clichansess;
 #endif
+#if DROPBEAR_CLI_MUX
+extern const struct ChanType climuxsess;
+#endif
 
 #if DROPBEAR_LISTENERS || DROPBEAR_CLIENT
 int send_msg_channel_open_init(int fd, const struct ChanType *type);
@@ -53,6 +53,7 @@ struct ChanSess {
 
 	/* exit details */
 	struct exitinfo exit;
+	int pidfd; /* watches pid for exit, -1 if SIGCHLD is used instead */
 
 
 	/* These are only set temporarily before forking */
@@ -46,6 +46,16 @@
 
 static int new_agent_chan(struct Channel * channel);
 
+/* The identities reply is kept for the life of the process, so that
+ * fan-out children forked after it was fetched don't each ask the agent
+ * again. It's fetched again if SSH_AUTH_SOCK names a different socket. */
+static struct {
+	buffer *reply;
+	char *sock;
+	dev_t dev;
+	ino_t ino;
+} agent_keys_cache;
+
 const struct ChanType cli_chan_agent = {
 	"auth-agent@openssh.com",
 	new_agent_chan,
@@ -115,8 +125,19 @@ static buffer * agent_request(unsigned char type, const buffer *data) {
 	buffer * inbuf = NULL;
 	size_t readlen = 0;
 	ssize_t ret;
-	const int fd = cli_opts.agent_fd;
+	int fd;
 	unsigned int data_len = 0;
+
+	/* Only connected once a request is needed, the key list may be cached.
+	 * agent_fd will be closed after successful auth */
+	if (cli_opts.agent_fd < 0) {
+		cli_opts.agent_fd = connect_agent();
+	}
+	fd = cli_opts.agent_fd;
+	if (fd < 0) {
+		return NULL;
+	}
+
 	if (data)
 	{
 		data_len = data->len;
@@ -145,7 +166,7 @@ static buffer * agent_request(unsigned char type, const buffer *data) {
 	ret = atomicio(read, fd, buf_getwriteptr(inbuf, 4), 4);
 	if (ret != 4) {
 		TRACE(("read of length failed for agent_request"))
-		goto out;
+		goto fail;
 	}
 	buf_setpos(inbuf, 0);
 	buf_setlen(inbuf, ret);
@@ -153,7 +174,7 @@ static buffer * agent_request(unsigned char type, const buffer *data) {
 	readlen = buf_getint(inbuf);
 	if (readlen > MAX_AGENT_REPLY) {
 		TRACE(("agent reply is too big"));
-		goto out;
+		goto fail;
 	}
 	
 	inbuf = buf_resize(inbuf, readlen);
@@ -161,10 +182,15 @@ static buffer * agent_request(unsigned char type, const buffer *data) {
 	ret = atomicio(read, fd, buf_getwriteptr(inbuf, readlen), readlen);
 	if ((size_t)ret != readlen) {
 		TRACE(("read of data failed for agent_request"))
-		goto out;
+		goto fail;
 	}
 	buf_incrwritepos(inbuf, readlen);
 	buf_setpos(inbuf, 0);
+	goto out;
+
+fail:
+	buf_free(inbuf);
+	inbuf = NULL;
 
 out:
 	if (payload)
@@ -173,6 +199,43 @@ out:
 	return inbuf;
 }
 
+/* Returns the identities reply for the current SSH_AUTH_SOCK, from the
+ * cache if it was fetched already, or NULL on failure. */
+static buffer * agent_get_identities() {
+	const char *agent_sock = getenv("SSH_AUTH_SOCK");
+	struct stat st;
+	buffer *reply = NULL;
+
+	if (agent_sock == NULL || stat(agent_sock, &st) < 0) {
+		return NULL;
+	}
+
+	if (agent_keys_cache.reply) {
+		if (strcmp(agent_keys_cache.sock, agent_sock) == 0
+				&& agent_keys_cache.dev == st.st_dev
+				&& agent_keys_cache.ino == st.st_ino) {
+			TRACE(("agent key list from cache"))
+			buf_setpos(agent_keys_cache.reply, 0);
+			return agent_keys_cache.reply;
+		}
+		TRACE(("agent socket changed, fetching key list again"))
+		buf_free(agent_keys_cache.reply);
+		m_free(agent_keys_cache.sock);
+		agent_keys_cache.reply = NULL;
+	}
+
+	reply = agent_request(SSH2_AGENTC_REQUEST_IDENTITIES, NULL);
+	if (!reply) {
+		TRACE(("agent_request failed returning identities"))
+		return NULL;
+	}
+	agent_keys_cache.reply = reply;
+	agent_keys_cache.sock = m_strdup(agent_sock);
+	agent_keys_cache.dev = st.st_dev;
+	agent_keys_cache.ino = st.st_ino;
+	return reply;
+}
+
 static void agent_get_key_list(m_list * ret_list)
 {
 	buffer * inbuf = NULL;
@@ -181,10 +244,9 @@ static void agent_get_key_list(m_list * ret_list)
 	unsigned int i;
 	int ret;
 
-	inbuf = agent_request(SSH2_AGENTC_REQUEST_IDENTITIES, NULL);
+	inbuf = agent_get_identities();
 	if (!inbuf) {
-		TRACE(("agent_request failed returning identities"))
-		goto out;
+		return;
 	}
 
 	/* The reply has a format of:
@@ -196,7 +258,7 @@ static void agent_get_key_list(m_list * ret_list)
 	 */
 	packet_type = buf_getbyte(inbuf);
 	if (packet_type != SSH2_AGENT_IDENTITIES_ANSWER) {
-		goto out;
+		return;
 	}
 
 	num = buf_getint(inbuf);
@@ -223,12 +285,6 @@ static void agent_get_key_list(m_list * ret_list)
 		/* We'll ignore the comment for now. might want it later.*/
 		buf_eatstring(inbuf);
 	}
-
-out:
-	if (inbuf) {
-		buf_free(inbuf);
-		inbuf = NULL;
-	}
 }
 
 void cli_setup_agent(const struct Channel *channel) {
@@ -245,13 +301,19 @@ void cli_setup_agent(const struct Channel *channel) {
 /* Returned keys are prepended to ret_list, which will
    be updated. */
 void cli_load_agent_keys(m_list *ret_list) {
-	/* agent_fd will be closed after successful auth */
-	cli_opts.agent_fd = connect_agent();
-	if (cli_opts.agent_fd < 0) {
+	agent_get_key_list(ret_list);
+}
+
+/* Fetches the key list before forking processes that will each
+ * authenticate. The connection isn't kept, requests from several processes
+ * on one agent socket would be interleaved. */
+void cli_agent_prefetch_keys() {
+	if (!getenv("SSH_AUTH_SOCK")) {
 		return;
 	}
-
-	agent_get_key_list(ret_list);
+	agent_get_identities();
+	m_close(cli_opts.agent_fd);
+	cli_opts.agent_fd = -1;
 }
 
 void agent_buf_sign(buffer *sigblob, sign_key *key, 
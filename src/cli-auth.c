@@ -196,7 +196,11 @@ void recv_msg_userauth_failure() {
 		/* If it was a pubkey auth request, we should cross that key 
 		 * off the list. */
 		if (cli_ses.lastauthtype == AUTH_TYPE_PUBKEY) {
-			cli_pubkeyfail();
+			if (cli_pubkeyfail()) {
+				/* Replies to other pipelined requests will follow */
+				TRACE(("leave recv_msg_userauth_failure, more pubkey replies pending"))
+				return;
+			}
 		}
 #endif
 
@@ -35,26 +35,47 @@
 #if DROPBEAR_CLI_PUBKEY_AUTH
 static void send_msg_userauth_pubkey(sign_key *key, enum signature_type sigtype, int realsign);
 
+/* Takes the key for the oldest pubkey request awaiting a reply. Replies
+ * come in the order that requests were sent, queries first since a signed
+ * request is only sent after a pk_ok. */
+static sign_key* pubkey_reply_key() {
+	sign_key *key = NULL;
+	if (cli_ses.pubkey_nqueried > 0) {
+		key = cli_ses.pubkey_queried[0];
+		cli_ses.pubkey_nqueried--;
+		memmove(cli_ses.pubkey_queried, &cli_ses.pubkey_queried[1],
+			cli_ses.pubkey_nqueried * sizeof(sign_key*));
+	} else {
+		key = cli_ses.pubkey_signed;
+		cli_ses.pubkey_signed = NULL;
+	}
+	return key;
+}
+
 /* Called when we receive a SSH_MSG_USERAUTH_FAILURE for a pubkey request.
- * We use it to remove the key we tried from the list */
-void cli_pubkeyfail() {
+ * We use it to remove the key we tried from the list.
+ * Returns 1 if replies to other pubkey requests are still to come */
+int cli_pubkeyfail() {
 	m_list_elem *iter;
+	sign_key *key = pubkey_reply_key();
+
 	for (iter = cli_opts.privkeys->first; iter; iter = iter->next) {
 		sign_key *iter_key = (sign_key*)iter->item;
 		
-		if (iter_key == cli_ses.lastprivkey)
+		if (iter_key == key)
 		{
 			/* found the failing key */
 			list_remove(iter);
 			sign_key_free(iter_key);
-			cli_ses.lastprivkey = NULL;
-			return;
+			break;
 		}
 	}
+	return cli_ses.pubkey_nqueried > 0 || cli_ses.pubkey_signed != NULL;
 }
 
 void recv_msg_userauth_pk_ok() {
 	m_list_elem *iter;
+	sign_key *querykey = NULL;
 	buffer* keybuf = NULL;
 	char* algotype = NULL;
 	unsigned int algolen;
@@ -64,6 +85,17 @@ void recv_msg_userauth_pk_ok() {
 
 	TRACE(("enter recv_msg_userauth_pk_ok"))
 
+	if (cli_ses.pubkey_nqueried == 0) {
+		dropbear_exit("Unexpected pk_ok");
+	}
+	querykey = pubkey_reply_key();
+	if (cli_ses.pubkey_signed) {
+		/* A key earlier in the list was accepted and is being used,
+		 * this one is kept in case that fails */
+		TRACE(("leave recv_msg_userauth_pk_ok, already signed with another key"))
+		return;
+	}
+
 	algotype = buf_getstring(ses.payload, &algolen);
 	sigtype = signature_type_from_name(algotype, algolen);
 	if (sigtype == DROPBEAR_SIGNATURE_NONE) {
@@ -114,11 +146,12 @@ void recv_msg_userauth_pk_ok() {
 	}
 	buf_free(keybuf);
 
-	if (iter != NULL) {
+	if (iter != NULL && iter->item == querykey) {
 		TRACE(("matching key"))
 		/* XXX TODO: if it's an encrypted key, here we ask for their
 		 * password */
-		send_msg_userauth_pubkey((sign_key*)iter->item, sigtype, 1);
+		send_msg_userauth_pubkey(querykey, sigtype, 1);
+		cli_ses.pubkey_signed = querykey;
 	} else {
 		TRACE(("That was whacky. We got told that a key was valid, but it didn't match our list. Sounds like dodgy code on Dropbear's part"))
 	}
@@ -187,91 +220,101 @@ static void send_msg_userauth_pubkey(sign_key *key, enum signature_type sigtype,
 	TRACE(("leave send_msg_userauth_pubkey"))
 }
 
-/* Returns 1 if a key was tried */
-int cli_auth_pubkey() {
+/* Returns the signature type to use with a key, or DROPBEAR_SIGNATURE_NONE
+ * if the server doesn't allow it */
+static enum signature_type pubkey_sigtype(const sign_key *key) {
 	enum signature_type sigtype = DROPBEAR_SIGNATURE_NONE;
-	TRACE(("enter cli_auth_pubkey"))
 
-#if DROPBEAR_CLI_AGENTFWD
-	if (!cli_opts.agent_keys_loaded) {
-		/* get the list of available keys from the agent */
-		cli_load_agent_keys(cli_opts.privkeys);
-		cli_opts.agent_keys_loaded = 1;
-		TRACE(("cli_auth_pubkey: agent keys loaded"))
-	}
-#endif
-
-	/* iterate through privkeys to remove ones not allowed in server-sig-algs */
- 	while (cli_opts.privkeys->first) {
-		sign_key * key = (sign_key*)cli_opts.privkeys->first->item;
-		if (cli_ses.server_sig_algs) {
+	if (cli_ses.server_sig_algs) {
 #if DROPBEAR_RSA
-			if (key->type == DROPBEAR_SIGNKEY_RSA) {
+		if (key->type == DROPBEAR_SIGNKEY_RSA) {
 #if DROPBEAR_RSA_SHA256
-				if (buf_has_algo(cli_ses.server_sig_algs, SSH_SIGNATURE_RSA_SHA256) 
-						== DROPBEAR_SUCCESS) {
-					sigtype = DROPBEAR_SIGNATURE_RSA_SHA256;
-					TRACE(("server-sig-algs allows rsa sha256"))
-					break;
-				}
+			if (buf_has_algo(cli_ses.server_sig_algs, SSH_SIGNATURE_RSA_SHA256) 
+					== DROPBEAR_SUCCESS) {
+				TRACE(("server-sig-algs allows rsa sha256"))
+				return DROPBEAR_SIGNATURE_RSA_SHA256;
+			}
 #endif /* DROPBEAR_RSA_SHA256 */
 #if DROPBEAR_RSA_SHA1
-				if (buf_has_algo(cli_ses.server_sig_algs, SSH_SIGNKEY_RSA)
-						== DROPBEAR_SUCCESS) {
-					sigtype = DROPBEAR_SIGNATURE_RSA_SHA1;
-					TRACE(("server-sig-algs allows rsa sha1"))
-					break;
-				}
+			if (buf_has_algo(cli_ses.server_sig_algs, SSH_SIGNKEY_RSA)
+					== DROPBEAR_SUCCESS) {
+				TRACE(("server-sig-algs allows rsa sha1"))
+				return DROPBEAR_SIGNATURE_RSA_SHA1;
+			}
 #endif /* DROPBEAR_RSA_SHA256 */
-			} else
+		} else
 #endif /* DROPBEAR_RSA */
-			{
-				/* Not RSA */
-				const char *name = NULL;
-				sigtype = signature_type_from_signkey(key->type);
-				name = signature_name_from_type(sigtype, NULL);
-				if (buf_has_algo(cli_ses.server_sig_algs, name)
-						== DROPBEAR_SUCCESS) {
-					TRACE(("server-sig-algs allows %s", name))
-					break;
-				}
+		{
+			/* Not RSA */
+			const char *name = NULL;
+			sigtype = signature_type_from_signkey(key->type);
+			name = signature_name_from_type(sigtype, NULL);
+			if (buf_has_algo(cli_ses.server_sig_algs, name)
+					== DROPBEAR_SUCCESS) {
+				TRACE(("server-sig-algs allows %s", name))
+				return sigtype;
 			}
+		}
 
-			/* No match, skip this key */
-			TRACE(("server-sig-algs no match keytype %d, skipping", key->type))
-			key = list_remove(cli_opts.privkeys->first);
-			sign_key_free(key); 
-			continue;
-		} else {
-			/* Server didn't provide a server-sig-algs list, we'll 
-			   assume all except rsa-sha256 are OK. */
+		/* No match, skip this key */
+		TRACE(("server-sig-algs no match keytype %d, skipping", key->type))
+		return DROPBEAR_SIGNATURE_NONE;
+	} else {
+		/* Server didn't provide a server-sig-algs list, we'll 
+		   assume all except rsa-sha256 are OK. */
 #if DROPBEAR_RSA
-			if (key->type == DROPBEAR_SIGNKEY_RSA) {
+		if (key->type == DROPBEAR_SIGNKEY_RSA) {
 #if DROPBEAR_RSA_SHA1
-				sigtype = DROPBEAR_SIGNATURE_RSA_SHA1;
-				TRACE(("no server-sig-algs, using rsa sha1"))
-				break;
+			TRACE(("no server-sig-algs, using rsa sha1"))
+			return DROPBEAR_SIGNATURE_RSA_SHA1;
 #else
-				/* only support rsa-sha256, skip this key */
-				TRACE(("no server-sig-algs, skipping rsa sha256"))
-				key = list_remove(cli_opts.privkeys->first);
-				sign_key_free(key); 
-				continue;
+			/* only support rsa-sha256, skip this key */
+			TRACE(("no server-sig-algs, skipping rsa sha256"))
+			return DROPBEAR_SIGNATURE_NONE;
 #endif
-			} /* key->type == DROPBEAR_SIGNKEY_RSA */
+		} /* key->type == DROPBEAR_SIGNKEY_RSA */
 #endif /* DROPBEAR_RSA */
-			sigtype = signature_type_from_signkey(key->type);
-			TRACE(("no server-sig-algs, using key"))
-			break;
+		TRACE(("no server-sig-algs, using key"))
+		return signature_type_from_signkey(key->type);
+	}
+}
+
+/* Returns 1 if a key was tried. With DROPBEAR_CLI_IMMEDIATE_AUTH several
+ * keys are queried at once, replies are matched up in order and a signed
+ * request is sent for the first one accepted. */
+int cli_auth_pubkey() {
+	enum signature_type sigtype = DROPBEAR_SIGNATURE_NONE;
+	m_list_elem *iter = NULL, *next = NULL;
+	TRACE(("enter cli_auth_pubkey"))
+
+#if DROPBEAR_CLI_AGENTFWD
+	if (!cli_opts.agent_keys_loaded) {
+		/* get the list of available keys from the agent */
+		cli_load_agent_keys(cli_opts.privkeys);
+		cli_opts.agent_keys_loaded = 1;
+		TRACE(("cli_auth_pubkey: agent keys loaded"))
+	}
+#endif
+
+	/* Send trial requests, removing keys not allowed in server-sig-algs */
+	iter = cli_opts.privkeys->first;
+	while (iter && cli_ses.pubkey_nqueried < CLI_PUBKEY_PIPELINE) {
+		sign_key *key = (sign_key*)iter->item;
+		next = iter->next;
+		sigtype = pubkey_sigtype(key);
+		if (sigtype == DROPBEAR_SIGNATURE_NONE) {
+			list_remove(iter);
+			sign_key_free(key);
+		} else {
+			send_msg_userauth_pubkey(key, sigtype, 0);
+			cli_ses.pubkey_queried[cli_ses.pubkey_nqueried] = key;
+			cli_ses.pubkey_nqueried++;
 		}
+		iter = next;
 	}
 
-	if (cli_opts.privkeys->first) {
-		sign_key * key = (sign_key*)cli_opts.privkeys->first->item;
-		/* Send a trial request */
-		send_msg_userauth_pubkey(key, sigtype, 0);
-		cli_ses.lastprivkey = key;
-		TRACE(("leave cli_auth_pubkey-success"))
+	if (cli_ses.pubkey_nqueried > 0) {
+		TRACE(("leave cli_auth_pubkey-success, %u queried", cli_ses.pubkey_nqueried))
 		return 1;
 	} else {
 		/* no more keys left */
@@ -40,7 +40,11 @@ void recv_msg_channel_extended_data() {
 
 	channel = getchannel();
 
-	if (channel->type != &clichansess) {
+	if (channel->type != &clichansess
+#if DROPBEAR_CLI_MUX
+		&& channel->type != &climuxsess
+#endif
+		) {
 		TRACE(("leave recv_msg_channel_extended_data: chantype is wrong"))
 		return; /* we just ignore it */
 	}
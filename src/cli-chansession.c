@@ -252,12 +252,10 @@ static void sigwinch_handler(int UNUSED(unused)) {
 
 void cli_chansess_winchange() {
 
-	unsigned int i;
 	struct Channel *channel = NULL;
 
-	for (i = 0; i < ses.chansize; i++) {
-		channel = ses.channels[i];
-		if (channel != NULL && channel->type == &clichansess) {
+	for (channel = ses.chanfirst; channel != NULL; channel = channel->chan_next) {
+		if (channel->type == &clichansess) {
 			CHECKCLEARTOWRITE();
 			buf_putbyte(ses.writepayload, SSH_MSG_CHANNEL_REQUEST);
 			buf_putint(ses.writepayload, channel->remotechan);
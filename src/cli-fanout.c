@@ -0,0 +1,265 @@
+#include "includes.h"
+#include "dbutil.h"
+#include "buffer.h"
+#include "dbrandom.h"
+#include "runopts.h"
+#include "fanout.h"
+#include "agentfwd.h"
+
+#if DROPBEAR_CLI_FANOUT
+
+/* each host has two pipes open in the parent, keep within select() */
+#define FANOUT_MAX_PARALLEL 256
+#define FANOUT_MAX_HOSTLINE 1000
+/* longer output lines are split */
+#define FANOUT_MAX_LINE 4096
+
+struct FanoutOutput {
+	int fd; /* -1 once closed */
+	FILE *dest;
+	buffer *line; /* a partial line */
+};
+
+struct FanoutHost {
+	char *host;
+	pid_t pid;
+	struct FanoutOutput out[2]; /* stdout, stderr */
+};
+
+static struct FanoutHost* read_hosts(const char *hostsfile, unsigned int *nhosts) {
+	struct FanoutHost *hosts = NULL;
+	unsigned int count = 0, alloc = 0;
+	buffer *line = NULL;
+	FILE *f = NULL;
+	char *host = NULL;
+
+	if (strcmp(hostsfile, "-") == 0) {
+		f = stdin;
+	} else {
+		f = fopen(hostsfile, "r");
+		if (f == NULL) {
+			dropbear_exit("Couldn't open '%s': %s", hostsfile, strerror(errno));
+		}
+	}
+
+	line = buf_new(FANOUT_MAX_HOSTLINE);
+	while (buf_getline(line, f) == DROPBEAR_SUCCESS) {
+		host = (char*)buf_getptr(line, line->len);
+		/* leading and trailing whitespace */
+		while (line->len > 0 && isspace((unsigned char)host[line->len-1])) {
+			line->len--;
+		}
+		while (line->len > 0 && isspace((unsigned char)host[0])) {
+			host++;
+			line->len--;
+		}
+		if (line->len == 0 || host[0] == '#') {
+			continue;
+		}
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			hosts = m_realloc(hosts, alloc * sizeof(struct FanoutHost));
+		}
+		memset(&hosts[count], 0, sizeof(struct FanoutHost));
+		hosts[count].host = m_malloc(line->len + 1);
+		memcpy(hosts[count].host, host, line->len);
+		hosts[count].host[line->len] = '\0';
+		count++;
+	}
+	buf_free(line);
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	if (count == 0) {
+		dropbear_exit("No hosts in '%s'", hostsfile);
+	}
+	*nhosts = count;
+	return hosts;
+}
+
+static void write_line(const char *host, FILE *dest,
+		const unsigned char *data, unsigned int len) {
+	fprintf(dest, "%s: %.*s\n", host, (int)len, data);
+}
+
+/* Writes out each complete line with the host's name before it */
+static void read_output(const char *host, struct FanoutOutput *o) {
+	unsigned char *nl = NULL;
+	unsigned int start = 0;
+	ssize_t len;
+
+	len = read(o->fd, o->line->data + o->line->len, o->line->size - o->line->len);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+	if (len <= 0) {
+		if (o->line->len > 0) {
+			write_line(host, o->dest, o->line->data, o->line->len);
+		}
+		m_close(o->fd);
+		o->fd = -1;
+		buf_free(o->line);
+		o->line = NULL;
+		return;
+	}
+
+	buf_setlen(o->line, o->line->len + len);
+	while ((nl = memchr(o->line->data + start, '\n', o->line->len - start)) != NULL) {
+		write_line(host, o->dest, o->line->data + start, nl - o->line->data - start);
+		start = nl - o->line->data + 1;
+	}
+	if (start == 0 && o->line->len == o->line->size) {
+		write_line(host, o->dest, o->line->data, o->line->len);
+		start = o->line->len;
+	}
+	memmove(o->line->data, o->line->data + start, o->line->len - start);
+	buf_setlen(o->line, o->line->len - start);
+}
+
+/* Returns 1 in the child */
+static int start_host(struct FanoutHost *hosts, unsigned int nhosts, unsigned int n) {
+	int outpipe[2], errpipe[2];
+	int devnull;
+	unsigned int i, j;
+	pid_t pid;
+
+	if (pipe(outpipe) < 0 || pipe(errpipe) < 0) {
+		dropbear_exit("Couldn't create pipe: %s", strerror(errno));
+	}
+
+	/* or the child would write out anything pending too */
+	fflush(stdout);
+	fflush(stderr);
+	seedrandom();
+	pid = fork();
+	if (pid < 0) {
+		dropbear_exit("Error forking: %s", strerror(errno));
+	}
+	/* the child mustn't generate the same numbers as the others */
+	addrandom((void*)&pid, sizeof(pid));
+
+	if (pid == 0) {
+		devnull = open(DROPBEAR_PATH_DEVNULL, O_RDONLY);
+		if (devnull < 0
+			|| dup2(devnull, STDIN_FILENO) < 0
+			|| dup2(outpipe[1], STDOUT_FILENO) < 0
+			|| dup2(errpipe[1], STDERR_FILENO) < 0) {
+			dropbear_exit("Couldn't set up output");
+		}
+		m_close(devnull);
+		m_close(outpipe[0]);
+		m_close(outpipe[1]);
+		m_close(errpipe[0]);
+		m_close(errpipe[1]);
+		/* other hosts' output */
+		for (i = 0; i < nhosts; i++) {
+			for (j = 0; j < 2; j++) {
+				if (hosts[i].out[j].fd >= 0) {
+					m_close(hosts[i].out[j].fd);
+				}
+			}
+		}
+		return 1;
+	}
+
+	m_close(outpipe[1]);
+	m_close(errpipe[1]);
+	hosts[n].pid = pid;
+	hosts[n].out[0].fd = outpipe[0];
+	hosts[n].out[0].dest = stdout;
+	hosts[n].out[0].line = buf_new(FANOUT_MAX_LINE);
+	hosts[n].out[1].fd = errpipe[0];
+	hosts[n].out[1].dest = stderr;
+	hosts[n].out[1].line = buf_new(FANOUT_MAX_LINE);
+	return 0;
+}
+
+/* Once both outputs have closed the child has exited or is about to */
+static int finish_host(const struct FanoutHost *h) {
+	int status, ret;
+
+	while (waitpid(h->pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return 255;
+		}
+	}
+	ret = WIFEXITED(status) ? WEXITSTATUS(status) : 255;
+	if (!cli_opts.quiet) {
+		fflush(stdout);
+		fprintf(stderr, "%s: exit status %d\n", h->host, ret);
+	}
+	return ret;
+}
+
+const char* cli_fanout(const char *hostsfile, unsigned int parallel) {
+	struct FanoutHost *hosts = NULL;
+	unsigned int nhosts, next = 0, running = 0, i, j;
+	int maxfd, status, ret = 0;
+	fd_set readfds;
+
+	hosts = read_hosts(hostsfile, &nhosts);
+	parallel = MIN(parallel, FANOUT_MAX_PARALLEL);
+	TRACE(("fanout to %u hosts, %u at a time", nhosts, parallel))
+	for (i = 0; i < nhosts; i++) {
+		hosts[i].out[0].fd = hosts[i].out[1].fd = -1;
+	}
+#if DROPBEAR_CLI_AGENTFWD
+	/* each host would otherwise ask the agent for the same keys */
+	cli_agent_prefetch_keys();
+#endif
+
+	for (;;) {
+		while (running < parallel && next < nhosts) {
+			if (start_host(hosts, nhosts, next)) {
+				return hosts[next].host;
+			}
+			next++;
+			running++;
+		}
+		if (running == 0) {
+			break;
+		}
+
+		FD_ZERO(&readfds);
+		maxfd = -1;
+		for (i = 0; i < next; i++) {
+			for (j = 0; j < 2; j++) {
+				if (hosts[i].out[j].fd >= 0) {
+					FD_SET(hosts[i].out[j].fd, &readfds);
+					maxfd = MAX(maxfd, hosts[i].out[j].fd);
+				}
+			}
+		}
+		if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			dropbear_exit("Error in select: %s", strerror(errno));
+		}
+
+		for (i = 0; i < next; i++) {
+			if (hosts[i].pid == 0) {
+				continue;
+			}
+			for (j = 0; j < 2; j++) {
+				if (hosts[i].out[j].fd >= 0
+					&& FD_ISSET(hosts[i].out[j].fd, &readfds)) {
+					read_output(hosts[i].host, &hosts[i].out[j]);
+				}
+			}
+			if (hosts[i].out[0].fd < 0 && hosts[i].out[1].fd < 0) {
+				status = finish_host(&hosts[i]);
+				ret = MAX(ret, status);
+				hosts[i].pid = 0;
+				running--;
+			}
+		}
+		fflush(stdout);
+		fflush(stderr);
+	}
+
+	exit(ret);
+}
+
+#endif /* DROPBEAR_CLI_FANOUT */
@@ -37,10 +37,10 @@
 #include "runopts.h"
 #include "signkey.h"
 #include "ecc.h"
+#include "knownhosts.h"
 
 
 static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen);
-#define MAX_KNOWNHOSTS_LINE 4500
 
 void send_msg_kexdh_init() {
 	TRACE(("send_msg_kexdh_init()"))	
@@ -254,7 +254,8 @@ static void ask_to_confirm(const unsigned char* keyblob, unsigned int keybloblen
 	dropbear_exit("Didn't validate host key");
 }
 
-static FILE* open_known_hosts_file(int * readonly)
+/* filename is set to the path of the file, to be freed */
+static FILE* open_known_hosts_file(int * readonly, char ** ret_filename)
 {
 	FILE * hostsfile = NULL;
 	char * filename = NULL;
@@ -310,20 +311,98 @@ static FILE* open_known_hosts_file(int * readonly)
 	}	
 
 out:
-	m_free(filename);
+	if (hostsfile != NULL) {
+		*ret_filename = filename;
+	} else {
+		m_free(filename);
+	}
 	return hostsfile;
 }
 
+/* Returns DROPBEAR_SUCCESS if the known_hosts line is a match for the host
+ * key, DROPBEAR_FAILURE if it is for another host or key type. Exits if the
+ * key differs */
+static int check_known_hosts_line(buffer *line, const unsigned char* keyblob,
+		unsigned int keybloblen, const char *algoname, unsigned int algolen,
+		char **fingerprint) {
+
+	unsigned int hostlen;
+	int ret;
+
+	hostlen = strlen(cli_opts.remotehost);
+
+	/* The line is too short to be sensible */
+	/* "30" is 'enough to hold ssh-dss plus the spaces, ie so we don't
+	 * buf_getfoo() past the end and die horribly - the base64 parsing
+	 * code is what tiptoes up to the end nicely */
+	if (line->len < (hostlen+30) ) {
+		TRACE(("line is too short to be sensible"))
+		return DROPBEAR_FAILURE;
+	}
+
+	/* Compare hostnames */
+	if (strncmp(cli_opts.remotehost, (const char *) buf_getptr(line, hostlen),
+				hostlen) != 0) {
+		return DROPBEAR_FAILURE;
+	}
+
+	buf_incrpos(line, hostlen);
+	if (buf_getbyte(line) != ' ') {
+		/* there wasn't a space after the hostname, something dodgy */
+		TRACE(("missing space afte matching hostname"))
+		return DROPBEAR_FAILURE;
+	}
+
+	if (strncmp((const char *) buf_getptr(line, algolen), algoname, algolen) != 0) {
+		TRACE(("algo doesn't match"))
+		return DROPBEAR_FAILURE;
+	}
+
+	buf_incrpos(line, algolen);
+	if (buf_getbyte(line) != ' ') {
+		TRACE(("missing space after algo"))
+		return DROPBEAR_FAILURE;
+	}
+
+	/* Now we're at the interesting hostkey */
+	ret = cmp_base64_key(keyblob, keybloblen, (const unsigned char *) algoname, algolen,
+					line, fingerprint);
+
+	if (ret == DROPBEAR_SUCCESS) {
+		/* Good matching key */
+		DEBUG1(("server match %s", *fingerprint))
+		return DROPBEAR_SUCCESS;
+	}
+
+	/* The keys didn't match. eep. Note that we're "leaking"
+	   the fingerprint strings here, but we're exiting anyway */
+	dropbear_exit("\n\n%s host key mismatch for %s !\n"
+				"Fingerprint is %s\n"
+				"Expected %s\n"
+				"If you know that the host key is correct you can\nremove the bad entry from ~/.ssh/known_hosts", 
+				algoname,
+				cli_opts.remotehost,
+				sign_key_fingerprint(keyblob, keybloblen),
+				*fingerprint ? *fingerprint : "UNKNOWN");
+	return DROPBEAR_FAILURE;
+}
+
 static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen) {
 
 	FILE *hostsfile = NULL;
+	char *filename = NULL;
 	int readonly = 0;
 	unsigned int hostlen, algolen;
 	unsigned long len;
+	long offset;
 	const char *algoname = NULL;
 	char * fingerprint = NULL;
 	buffer * line = NULL;
-	int ret;
+#if DROPBEAR_CLI_KNOWNHOSTS_INDEX
+	struct knownhosts_index *idx = NULL;
+	long *offsets = NULL;
+	unsigned int i, count;
+#endif
 
 	if (cli_opts.no_hostkey_check) {
 		dropbear_log(LOG_INFO, "Caution, skipping hostkey check for %s\n", cli_opts.remotehost);
@@ -332,7 +411,7 @@ static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen)
 
 	algoname = signkey_name_from_type(ses.newkeys->algo_hostkey, &algolen);
 
-	hostsfile = open_known_hosts_file(&readonly);
+	hostsfile = open_known_hosts_file(&readonly, &filename);
 	if (!hostsfile)	{
 		ask_to_confirm(keyblob, keybloblen, algoname);
 		/* ask_to_confirm will exit upon failure */
@@ -342,66 +421,35 @@ static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen)
 	line = buf_new(MAX_KNOWNHOSTS_LINE);
 	hostlen = strlen(cli_opts.remotehost);
 
-	do {
-		if (buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
-			TRACE(("failed reading line: prob EOF"))
-			break;
-		}
-
-		/* The line is too short to be sensible */
-		/* "30" is 'enough to hold ssh-dss plus the spaces, ie so we don't
-		 * buf_getfoo() past the end and die horribly - the base64 parsing
-		 * code is what tiptoes up to the end nicely */
-		if (line->len < (hostlen+30) ) {
-			TRACE(("line is too short to be sensible"))
-			continue;
-		}
-
-		/* Compare hostnames */
-		if (strncmp(cli_opts.remotehost, (const char *) buf_getptr(line, hostlen),
-					hostlen) != 0) {
-			continue;
-		}
-
-		buf_incrpos(line, hostlen);
-		if (buf_getbyte(line) != ' ') {
-			/* there wasn't a space after the hostname, something dodgy */
-			TRACE(("missing space afte matching hostname"))
-			continue;
-		}
-
-		if (strncmp((const char *) buf_getptr(line, algolen), algoname, algolen) != 0) {
-			TRACE(("algo doesn't match"))
-			continue;
-		}
-
-		buf_incrpos(line, algolen);
-		if (buf_getbyte(line) != ' ') {
-			TRACE(("missing space after algo"))
-			continue;
-		}
-
-		/* Now we're at the interesting hostkey */
-		ret = cmp_base64_key(keyblob, keybloblen, (const unsigned char *) algoname, algolen,
-						line, &fingerprint);
-
-		if (ret == DROPBEAR_SUCCESS) {
-			/* Good matching key */
-			DEBUG1(("server match %s", fingerprint))
-			goto out;
+#if DROPBEAR_CLI_KNOWNHOSTS_INDEX
+	idx = knownhosts_index_open(filename, hostsfile);
+	if (idx) {
+		/* Only the lines for this host */
+		count = knownhosts_index_lookup(idx, cli_opts.remotehost, hostlen, &offsets);
+		for (i = 0; i < count; i++) {
+			if (fseek(hostsfile, offsets[i], SEEK_SET) != 0
+				|| buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
+				break;
+			}
+			if (check_known_hosts_line(line, keyblob, keybloblen,
+					algoname, algolen, &fingerprint) == DROPBEAR_SUCCESS) {
+				goto out;
+			}
 		}
-
-		/* The keys didn't match. eep. Note that we're "leaking"
-		   the fingerprint strings here, but we're exiting anyway */
-		dropbear_exit("\n\n%s host key mismatch for %s !\n"
-					"Fingerprint is %s\n"
-					"Expected %s\n"
-					"If you know that the host key is correct you can\nremove the bad entry from ~/.ssh/known_hosts", 
-					algoname,
-					cli_opts.remotehost,
-					sign_key_fingerprint(keyblob, keybloblen),
-					fingerprint ? fingerprint : "UNKNOWN");
-	} while (1); /* keep going 'til something happens */
+	} else
+#endif
+	{
+		do {
+			if (buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
+				TRACE(("failed reading line: prob EOF"))
+				break;
+			}
+			if (check_known_hosts_line(line, keyblob, keybloblen,
+					algoname, algolen, &fingerprint) == DROPBEAR_SUCCESS) {
+				goto out;
+			}
+		} while (1); /* keep going 'til something happens */
+	}
 
 	/* Key doesn't exist yet */
 	ask_to_confirm(keyblob, keybloblen, algoname);
@@ -416,6 +464,7 @@ static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen)
 	if (!cli_opts.no_hostkey_check) {
 		/* put the new entry in the file */
 		fseek(hostsfile, 0, SEEK_END); /* In case it wasn't opened append */
+		offset = ftell(hostsfile);
 		buf_setpos(line, 0);
 		buf_setlen(line, 0);
 		buf_putbytes(line, (const unsigned char *) cli_opts.remotehost, hostlen);
@@ -431,9 +480,21 @@ static void checkhostkey(const unsigned char* keyblob, unsigned int keybloblen)
 		buf_setpos(line, 0);
 		fwrite(buf_getptr(line, line->len), line->len, 1, hostsfile);
 		/* We ignore errors, since there's not much we can do about them */
+#if DROPBEAR_CLI_KNOWNHOSTS_INDEX
+		if (idx) {
+			knownhosts_index_add(idx, hostsfile, cli_opts.remotehost, hostlen, offset);
+		}
+#endif
 	}
 
 out:
+#if DROPBEAR_CLI_KNOWNHOSTS_INDEX
+	if (idx) {
+		knownhosts_index_close(idx);
+	}
+	m_free(offsets);
+#endif
+	m_free(filename);
 	if (hostsfile != NULL) {
 		fclose(hostsfile);
 	}
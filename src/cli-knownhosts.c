@@ -0,0 +1,320 @@
+#include "includes.h"
+#include "dbutil.h"
+#include "buffer.h"
+#include "atomicio.h"
+#include "knownhosts.h"
+
+#if DROPBEAR_CLI_KNOWNHOSTS_INDEX
+
+/* Smaller files are quick enough to read through */
+#define KNOWNHOSTS_INDEX_MIN_SIZE 65536
+#define KNOWNHOSTS_INDEX_SUFFIX ".idx"
+#define KNOWNHOSTS_INDEX_MAGIC "dbkhidx1"
+
+/* The index is a cache for this machine, so is stored in native byte order.
+ * The header is followed by the entries sorted by hash then offset */
+struct knownhosts_index_header {
+	char magic[8];
+	/* known_hosts when the index was written */
+	uint64_t size;
+	int64_t mtime;
+	uint64_t ino;
+	uint32_t count;
+	uint32_t pad;
+};
+
+struct knownhosts_index_entry {
+	uint32_t hash; /* of the hostname field */
+	uint32_t offset;
+};
+
+struct knownhosts_index {
+	char *path;
+	/* the index file, or -1 if entries are held in memory */
+	int fd;
+	struct knownhosts_index_header header;
+	struct knownhosts_index_entry *entries;
+};
+
+/* FNV-1a */
+static uint32_t knownhosts_hash(const char *host, unsigned int hostlen) {
+	uint32_t h = 2166136261U;
+	unsigned int i;
+
+	for (i = 0; i < hostlen; i++) {
+		h ^= (unsigned char)host[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+	const struct knownhosts_index_entry *ea = a, *eb = b;
+
+	if (ea->hash != eb->hash) {
+		return ea->hash < eb->hash ? -1 : 1;
+	}
+	if (ea->offset != eb->offset) {
+		return ea->offset < eb->offset ? -1 : 1;
+	}
+	return 0;
+}
+
+static void set_header_stat(struct knownhosts_index_header *header,
+		const struct stat *st, uint32_t count) {
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, KNOWNHOSTS_INDEX_MAGIC, sizeof(header->magic));
+	header->size = st->st_size;
+	header->mtime = st->st_mtime;
+	header->ino = st->st_ino;
+	header->count = count;
+}
+
+/* Writes via a temporary file so that others never see a partial index */
+static void write_index(const struct knownhosts_index *idx) {
+	char *tmppath = NULL;
+	int fd = -1;
+	size_t len;
+	int ok = 0;
+
+	len = strlen(idx->path) + 5;
+	tmppath = m_malloc(len);
+	snprintf(tmppath, len, "%s.tmp", idx->path);
+
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		TRACE(("knownhosts index: can't create %s: %s", tmppath, strerror(errno)))
+		goto out;
+	}
+
+	len = idx->header.count * sizeof(struct knownhosts_index_entry);
+	if (atomicio(vwrite, fd, (void*)&idx->header, sizeof(idx->header)) != sizeof(idx->header)
+		|| atomicio(vwrite, fd, idx->entries, len) != len) {
+		TRACE(("knownhosts index: write failed"))
+		goto out;
+	}
+	if (close(fd) == 0) {
+		ok = (rename(tmppath, idx->path) == 0);
+	}
+	fd = -1;
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (!ok) {
+		unlink(tmppath);
+	}
+	m_free(tmppath);
+}
+
+/* Reads through known_hosts, the entries are left in memory */
+static int build_index(struct knownhosts_index *idx, FILE *hostsfile,
+		const struct stat *st) {
+	buffer *line = NULL;
+	unsigned int count = 0, alloc = 1024, hostlen;
+	unsigned char *space = NULL;
+	long offset;
+	int ret = DROPBEAR_FAILURE;
+
+	if ((uint64_t)st->st_size > 0xffffffffUL) {
+		/* offsets are 32 bit */
+		return DROPBEAR_FAILURE;
+	}
+
+	idx->entries = m_malloc(alloc * sizeof(struct knownhosts_index_entry));
+	line = buf_new(MAX_KNOWNHOSTS_LINE);
+
+	fseek(hostsfile, 0, SEEK_SET);
+	for (;;) {
+		offset = ftell(hostsfile);
+		if (offset < 0) {
+			goto out;
+		}
+		if (buf_getline(line, hostsfile) == DROPBEAR_FAILURE) {
+			break;
+		}
+		space = memchr(line->data, ' ', line->len);
+		if (space == NULL) {
+			continue;
+		}
+		hostlen = space - line->data;
+
+		if (count == alloc) {
+			alloc *= 2;
+			idx->entries = m_realloc(idx->entries,
+				alloc * sizeof(struct knownhosts_index_entry));
+		}
+		idx->entries[count].hash = knownhosts_hash((const char*)line->data, hostlen);
+		idx->entries[count].offset = offset;
+		count++;
+	}
+
+	qsort(idx->entries, count, sizeof(struct knownhosts_index_entry), entry_cmp);
+	set_header_stat(&idx->header, st, count);
+	ret = DROPBEAR_SUCCESS;
+	TRACE(("knownhosts index: built with %u entries", count))
+
+out:
+	buf_free(line);
+	return ret;
+}
+
+/* Returns DROPBEAR_SUCCESS if the index on disk matches known_hosts */
+static int open_existing(struct knownhosts_index *idx, const struct stat *st) {
+	struct stat idxst;
+	int fd;
+
+	fd = open(idx->path, O_RDONLY);
+	if (fd < 0) {
+		return DROPBEAR_FAILURE;
+	}
+	if (atomicio(read, fd, &idx->header, sizeof(idx->header)) != sizeof(idx->header)
+		|| memcmp(idx->header.magic, KNOWNHOSTS_INDEX_MAGIC, sizeof(idx->header.magic)) != 0
+		|| idx->header.size != (uint64_t)st->st_size
+		|| idx->header.mtime != (int64_t)st->st_mtime
+		|| idx->header.ino != (uint64_t)st->st_ino
+		|| fstat(fd, &idxst) != 0
+		|| (uint64_t)idxst.st_size != sizeof(idx->header)
+			+ (uint64_t)idx->header.count * sizeof(struct knownhosts_index_entry)) {
+		TRACE(("knownhosts index: stale"))
+		close(fd);
+		return DROPBEAR_FAILURE;
+	}
+	idx->fd = fd;
+	return DROPBEAR_SUCCESS;
+}
+
+struct knownhosts_index* knownhosts_index_open(const char *filename, FILE *hostsfile) {
+	struct knownhosts_index *idx = NULL;
+	struct stat st;
+	size_t len;
+
+	if (fstat(fileno(hostsfile), &st) != 0
+		|| st.st_size < KNOWNHOSTS_INDEX_MIN_SIZE) {
+		return NULL;
+	}
+
+	idx = m_malloc(sizeof(*idx));
+	idx->fd = -1;
+	idx->entries = NULL;
+	len = strlen(filename) + sizeof(KNOWNHOSTS_INDEX_SUFFIX);
+	idx->path = m_malloc(len);
+	snprintf(idx->path, len, "%s%s", filename, KNOWNHOSTS_INDEX_SUFFIX);
+
+	if (open_existing(idx, &st) == DROPBEAR_SUCCESS) {
+		return idx;
+	}
+
+	if (build_index(idx, hostsfile, &st) == DROPBEAR_FAILURE) {
+		knownhosts_index_close(idx);
+		return NULL;
+	}
+	/* failing to save it only costs the next connection a rebuild */
+	write_index(idx);
+	return idx;
+}
+
+static int get_entry(const struct knownhosts_index *idx, unsigned int i,
+		struct knownhosts_index_entry *entry) {
+	off_t pos;
+
+	if (idx->entries) {
+		*entry = idx->entries[i];
+		return DROPBEAR_SUCCESS;
+	}
+	pos = sizeof(idx->header) + (off_t)i * sizeof(*entry);
+	if (pread(idx->fd, entry, sizeof(*entry), pos) != sizeof(*entry)) {
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+unsigned int knownhosts_index_lookup(const struct knownhosts_index *idx,
+		const char *host, unsigned int hostlen, long **offsets) {
+	struct knownhosts_index_entry entry;
+	unsigned int lo, hi, mid, count = 0;
+	uint32_t hash;
+
+	*offsets = NULL;
+	hash = knownhosts_hash(host, hostlen);
+
+	/* first entry with the hash */
+	lo = 0;
+	hi = idx->header.count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (get_entry(idx, mid, &entry) == DROPBEAR_FAILURE) {
+			return 0;
+		}
+		if (entry.hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < idx->header.count; lo++) {
+		if (get_entry(idx, lo, &entry) == DROPBEAR_FAILURE
+			|| entry.hash != hash) {
+			break;
+		}
+		*offsets = m_realloc(*offsets, (count+1) * sizeof(long));
+		(*offsets)[count] = entry.offset;
+		count++;
+	}
+	TRACE(("knownhosts index: %u candidates for %s", count, host))
+	return count;
+}
+
+void knownhosts_index_add(struct knownhosts_index *idx, FILE *hostsfile,
+		const char *host, unsigned int hostlen, long offset) {
+	struct knownhosts_index_entry entry;
+	struct stat st;
+	size_t len;
+	unsigned int i;
+
+	fflush(hostsfile);
+	if ((uint64_t)offset != idx->header.size
+		|| fstat(fileno(hostsfile), &st) != 0
+		|| (uint64_t)st.st_size > 0xffffffffUL) {
+		/* another process has written known_hosts meanwhile */
+		TRACE(("knownhosts index: dropping"))
+		unlink(idx->path);
+		return;
+	}
+
+	if (idx->entries == NULL) {
+		len = idx->header.count * sizeof(struct knownhosts_index_entry);
+		idx->entries = m_malloc(len + sizeof(struct knownhosts_index_entry));
+		if (pread(idx->fd, idx->entries, len, sizeof(idx->header)) != (ssize_t)len) {
+			unlink(idx->path);
+			return;
+		}
+	} else {
+		idx->entries = m_realloc(idx->entries,
+			(idx->header.count + 1) * sizeof(struct knownhosts_index_entry));
+	}
+
+	/* insert in order, the new offset is after any other for the hash */
+	entry.hash = knownhosts_hash(host, hostlen);
+	entry.offset = offset;
+	for (i = idx->header.count; i > 0 && entry_cmp(&idx->entries[i-1], &entry) > 0; i--) {
+		idx->entries[i] = idx->entries[i-1];
+	}
+	idx->entries[i] = entry;
+
+	set_header_stat(&idx->header, &st, idx->header.count + 1);
+	write_index(idx);
+}
+
+void knownhosts_index_close(struct knownhosts_index *idx) {
+	if (idx->fd >= 0) {
+		close(idx->fd);
+	}
+	m_free(idx->entries);
+	m_free(idx->path);
+	m_free(idx);
+}
+
+#endif /* DROPBEAR_CLI_KNOWNHOSTS_INDEX */
@@ -32,6 +32,7 @@
 #include "crypto_desc.h"
 #include "netio.h"
 #include "fuzz.h"
+#include "mux.h"
 
 #if DROPBEAR_CLI_PROXYCMD
 static void cli_proxy_cmd(int *sock_in, int *sock_out, pid_t *pid_out);
@@ -76,6 +77,11 @@ int main(int argc, char ** argv) {
 		dropbear_exit("signal() error");
 	}
 
+#if DROPBEAR_CLI_MUX
+	/* Doesn't return if a master ran the command */
+	cli_mux_client();
+#endif
+
 #if DROPBEAR_CLI_PROXYCMD
 	if (cli_opts.proxycmd) {
 		cli_proxy_cmd(&sock_in, &sock_out, &proxy_cmd_pid);
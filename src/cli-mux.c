@@ -0,0 +1,489 @@
+#include "includes.h"
+#include "dbutil.h"
+#include "buffer.h"
+#include "session.h"
+#include "channel.h"
+#include "listener.h"
+#include "runopts.h"
+#include "atomicio.h"
+#include "mux.h"
+
+#if DROPBEAR_CLI_MUX
+
+/* A request from a client is
+ *   uint32  length of the rest
+ *   uint32  MUX_VERSION
+ *   byte    1 for a subsystem
+ *   string  command, empty for a shell
+ * sent along with its stdin, stdout and stderr. The master replies with
+ *   uint32  exit status
+ * once the channel has closed. */
+#define MUX_VERSION 1
+#define MUX_NFDS 3
+#define MUX_MAX_REQUEST 65536
+/* status for a command that couldn't be run, as for a failed connection */
+#define MUX_STATUS_FAILED 255
+
+struct MuxSession {
+	int ctlfd;
+	int fds[MUX_NFDS];
+	int is_subsystem;
+	char *cmd; /* NULL for a shell */
+	int started; /* the channel has taken fds */
+	int exitstatus;
+};
+
+static int mux_initchansess(struct Channel *channel);
+static void mux_chansessreq(struct Channel *channel);
+static void mux_cleanupchansess(const struct Channel *channel);
+
+const struct ChanType climuxsess = {
+	"session", /* name */
+	mux_initchansess, /* inithandler */
+	NULL, /* checkclosehandler */
+	mux_chansessreq, /* reqhandler */
+	NULL, /* closehandler */
+	mux_cleanupchansess, /* cleanup */
+};
+
+static int mux_sockaddr(struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(cli_opts.control_path) >= sizeof(addr->sun_path)) {
+		dropbear_log(LOG_WARNING, "ControlPath '%s' is too long",
+			cli_opts.control_path);
+		return DROPBEAR_FAILURE;
+	}
+	strlcpy(addr->sun_path, cli_opts.control_path, sizeof(addr->sun_path));
+	return DROPBEAR_SUCCESS;
+}
+
+/* Returns a socket connected to a master, or -1 */
+static int mux_connect(void) {
+	struct sockaddr_un addr;
+	int sock;
+
+	if (mux_sockaddr(&addr) == DROPBEAR_FAILURE) {
+		return -1;
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		TRACE(("mux: no master on %s: %s", cli_opts.control_path, strerror(errno)))
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int mux_send_request(int sock, const buffer *buf) {
+	int fds[MUX_NFDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg = NULL;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = buf->data;
+	iov.iov_len = buf->len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	do {
+		ret = sendmsg(sock, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		return DROPBEAR_FAILURE;
+	}
+	/* the fds went with the first part */
+	if ((size_t)ret < buf->len
+		&& atomicio(vwrite, sock, buf->data + ret, buf->len - ret)
+			!= (size_t)(buf->len - ret)) {
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+void cli_mux_client() {
+	buffer *buf = NULL;
+	unsigned char status[4];
+	int flags[MUX_NFDS];
+	int sock, i, ok;
+
+	if (cli_opts.control_path == NULL
+		|| cli_opts.control_master == MUX_MASTER_YES) {
+		return;
+	}
+	/* Only plain commands go through a master, it doesn't set up ptys
+	 * or forwardings for clients */
+	if (cli_opts.wantpty || cli_opts.no_cmd || cli_opts.backgrounded
+#if DROPBEAR_CLI_NETCAT
+		|| cli_opts.netcat_host
+#endif
+#if DROPBEAR_CLI_LOCALTCPFWD
+		|| cli_opts.localfwds->first
+#endif
+#if DROPBEAR_CLI_REMOTETCPFWD
+		|| cli_opts.remotefwds->first
+#endif
+		) {
+		TRACE(("mux: not for this session"))
+		return;
+	}
+
+	sock = mux_connect();
+	if (sock < 0) {
+		return;
+	}
+
+	buf = buf_new(MUX_MAX_REQUEST);
+	buf_putint(buf, 0);
+	buf_putint(buf, MUX_VERSION);
+	buf_putbyte(buf, cli_opts.is_subsystem);
+	if (cli_opts.cmd) {
+		buf_putstring(buf, cli_opts.cmd, strlen(cli_opts.cmd));
+	} else {
+		buf_putstring(buf, "", 0);
+	}
+	buf_setpos(buf, 0);
+	buf_putint(buf, buf->len - 4);
+
+	/* The master makes them non-blocking, which is shared with us */
+	for (i = 0; i < MUX_NFDS; i++) {
+		flags[i] = fcntl(i, F_GETFL, 0);
+	}
+
+	ok = mux_send_request(sock, buf);
+	buf_free(buf);
+	if (ok == DROPBEAR_FAILURE) {
+		TRACE(("mux: request failed: %s", strerror(errno)))
+		close(sock);
+		return;
+	}
+
+	ok = (atomicio(read, sock, status, sizeof(status)) == sizeof(status));
+	for (i = 0; i < MUX_NFDS; i++) {
+		if (flags[i] >= 0) {
+			(void)fcntl(i, F_SETFL, flags[i]);
+		}
+	}
+	if (!ok) {
+		dropbear_exit("Control master closed");
+	}
+	exit((status[0] << 24) | (status[1] << 16) | (status[2] << 8) | status[3]);
+}
+
+static void mux_reply(int ctlfd, int exitstatus) {
+	unsigned char status[4];
+
+	status[0] = (exitstatus >> 24) & 0xff;
+	status[1] = (exitstatus >> 16) & 0xff;
+	status[2] = (exitstatus >> 8) & 0xff;
+	status[3] = exitstatus & 0xff;
+	/* the client may have gone already */
+	(void)atomicio(vwrite, ctlfd, status, sizeof(status));
+}
+
+/* Reads a request and its fds. Clients are the same user, so it's
+ * read blocking like a local file */
+static buffer* mux_recv_request(int sock, int fds[MUX_NFDS]) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * MUX_NFDS)];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg = NULL;
+	buffer *buf = NULL;
+	unsigned int len;
+	ssize_t ret;
+	unsigned int i;
+	int nfds = 0, fd;
+
+	buf = buf_new(MUX_MAX_REQUEST);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf->data;
+	iov.iov_len = 4;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		ret = recvmsg(sock, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		goto fail;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (nfds < MUX_NFDS) {
+				fds[nfds] = fd;
+			} else {
+				close(fd);
+			}
+			nfds++;
+		}
+	}
+	if (nfds != MUX_NFDS || (msg.msg_flags & MSG_CTRUNC)) {
+		TRACE(("mux: got %d fds", nfds))
+		for (i = 0; i < (unsigned int)MIN(nfds, MUX_NFDS); i++) {
+			close(fds[i]);
+		}
+		goto fail;
+	}
+
+	if (ret < 4 && atomicio(read, sock, buf->data + ret, 4 - ret) != (size_t)(4 - ret)) {
+		goto failfds;
+	}
+	buf_setlen(buf, 4);
+	len = buf_getint(buf);
+	if (len < 9 || len > MUX_MAX_REQUEST - 4
+		|| atomicio(read, sock, buf_getwriteptr(buf, len), len) != len) {
+		goto failfds;
+	}
+	buf_incrwritepos(buf, len);
+	buf_setpos(buf, 4);
+	return buf;
+
+failfds:
+	for (i = 0; i < MUX_NFDS; i++) {
+		close(fds[i]);
+	}
+fail:
+	buf_free(buf);
+	return NULL;
+}
+
+static void mux_accept(const struct Listener *UNUSED(listener), int sock) {
+	struct MuxSession *mux = NULL;
+	buffer *req = NULL;
+	unsigned int cmdlen;
+	int fd, i;
+
+	fd = accept(sock, NULL, NULL);
+	if (fd < 0) {
+		TRACE(("mux: accept failed"))
+		return;
+	}
+
+	mux = m_malloc(sizeof(*mux));
+	mux->ctlfd = fd;
+	/* unless the server sends one */
+	mux->exitstatus = MUX_STATUS_FAILED;
+	req = mux_recv_request(fd, mux->fds);
+	if (req == NULL) {
+		TRACE(("mux: bad request"))
+		m_close(fd);
+		m_free(mux);
+		return;
+	}
+
+	if (buf_getint(req) != MUX_VERSION) {
+		dropbear_log(LOG_WARNING, "Unknown control client version");
+		goto fail;
+	}
+	mux->is_subsystem = buf_getbool(req);
+	cmdlen = buf_getint(req);
+	if (cmdlen != req->len - req->pos) {
+		goto fail;
+	}
+	if (cmdlen > 0) {
+		mux->cmd = m_malloc(cmdlen + 1);
+		memcpy(mux->cmd, buf_getptr(req, cmdlen), cmdlen);
+		mux->cmd[cmdlen] = '\0';
+	}
+	buf_free(req);
+	req = NULL;
+
+	TRACE(("mux: running '%s'", mux->cmd ? mux->cmd : "shell"))
+	if (send_msg_channel_open_init(mux->fds[0], &climuxsess) == DROPBEAR_FAILURE) {
+		dropbear_log(LOG_WARNING, "Couldn't open a channel for a control client");
+		goto fail;
+	}
+	/* the channel just created */
+	ses.chanlast->typedata = mux;
+	encrypt_packet();
+	cli_ses.mux_idle_since = 0;
+	return;
+
+fail:
+	if (req) {
+		buf_free(req);
+	}
+	mux_reply(fd, MUX_STATUS_FAILED);
+	for (i = 0; i < MUX_NFDS; i++) {
+		m_close(mux->fds[i]);
+	}
+	m_close(fd);
+	m_free(mux->cmd);
+	m_free(mux);
+}
+
+static int mux_initchansess(struct Channel *channel) {
+	struct MuxSession *mux = channel->typedata;
+	char *reqtype = NULL;
+
+	channel->readfd = mux->fds[0];
+	channel->writefd = mux->fds[1];
+	channel->errfd = mux->fds[2];
+	setnonblocking(channel->writefd);
+	setnonblocking(channel->errfd);
+	ses.maxfd = MAX(ses.maxfd, MAX(channel->writefd, channel->errfd));
+
+	channel->extrabuf = cbuf_new(opts.recv_window);
+	channel->bidir_fd = 0;
+	mux->started = 1;
+
+	if (mux->cmd) {
+		reqtype = mux->is_subsystem ? "subsystem" : "exec";
+	} else {
+		reqtype = "shell";
+	}
+	start_send_channel_request(channel, reqtype);
+	buf_putbyte(ses.writepayload, 0); /* Don't want replies */
+	if (mux->cmd) {
+		buf_putstring(ses.writepayload, mux->cmd, strlen(mux->cmd));
+	}
+	encrypt_packet();
+	return 0;
+}
+
+static void mux_chansessreq(struct Channel *channel) {
+	struct MuxSession *mux = channel->typedata;
+	char *type = NULL;
+	int wantreply;
+
+	type = buf_getstring(ses.payload, NULL);
+	wantreply = buf_getbool(ses.payload);
+
+	if (strcmp(type, "exit-status") == 0) {
+		mux->exitstatus = buf_getint(ses.payload);
+		TRACE(("mux: exit-status %d", mux->exitstatus))
+	} else if (strcmp(type, "exit-signal") == 0) {
+		TRACE(("mux: got exit-signal, ignoring it"))
+	} else if (wantreply) {
+		send_msg_channel_failure(channel);
+	}
+	m_free(type);
+}
+
+/* The channel's fds have been closed, so all output has been written */
+static void mux_cleanupchansess(const struct Channel *channel) {
+	struct MuxSession *mux = channel->typedata;
+
+	if (!mux->started) {
+		/* the open failed, stdin went as the channel's readfd */
+		m_close(mux->fds[1]);
+		m_close(mux->fds[2]);
+	}
+	mux_reply(mux->ctlfd, mux->exitstatus);
+	m_close(mux->ctlfd);
+	m_free(mux->cmd);
+	m_free(mux);
+}
+
+static long mux_select_timeout(time_t now) {
+	long remain;
+
+	if (cli_ses.mux_idle_since == 0 || cli_opts.control_persist == 0) {
+		return -1;
+	}
+	remain = (long)cli_opts.control_persist - (long)(now - cli_ses.mux_idle_since);
+	return MAX(remain, 0);
+}
+
+void cli_mux_master_listen() {
+	struct sockaddr_un addr;
+	mode_t oldmask;
+	int sock;
+
+	if (cli_opts.control_path == NULL
+		|| cli_opts.control_master == MUX_MASTER_NO) {
+		return;
+	}
+
+	sock = mux_connect();
+	if (sock >= 0) {
+		dropbear_log(LOG_WARNING, "ControlPath '%s' is already in use",
+			cli_opts.control_path);
+		close(sock);
+		return;
+	}
+	if (mux_sockaddr(&addr) == DROPBEAR_FAILURE) {
+		return;
+	}
+	/* nothing answered, so it's left over from a master that died */
+	unlink(cli_opts.control_path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		dropbear_log(LOG_WARNING, "Control socket failed: %s", strerror(errno));
+		return;
+	}
+	oldmask = umask(0177);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0
+		|| listen(sock, DROPBEAR_LISTEN_BACKLOG) < 0) {
+		umask(oldmask);
+		dropbear_log(LOG_WARNING, "Couldn't listen on ControlPath '%s': %s",
+			cli_opts.control_path, strerror(errno));
+		close(sock);
+		return;
+	}
+	umask(oldmask);
+	setnonblocking(sock);
+
+	if (new_listener(&sock, 1, CHANNEL_ID_MUX, NULL, mux_accept, NULL) == NULL) {
+		unlink(cli_opts.control_path);
+		return;
+	}
+	cli_ses.mux_path = m_strdup(cli_opts.control_path);
+	ses.extra_select_timeout = mux_select_timeout;
+	TRACE(("mux: listening on %s", cli_ses.mux_path))
+}
+
+int cli_mux_persist_expired() {
+	time_t now;
+
+	if (cli_ses.mux_path == NULL || cli_opts.control_persist == 0) {
+		return 0;
+	}
+	if (ses.chancount > 0) {
+		cli_ses.mux_idle_since = 0;
+		return 0;
+	}
+	now = monotonic_now();
+	if (cli_ses.mux_idle_since == 0) {
+		cli_ses.mux_idle_since = now;
+		return 0;
+	}
+	return now - cli_ses.mux_idle_since >= (time_t)cli_opts.control_persist;
+}
+
+void cli_mux_cleanup() {
+	if (cli_ses.mux_path) {
+		unlink(cli_ses.mux_path);
+		m_free(cli_ses.mux_path);
+	}
+}
+
+#endif /* DROPBEAR_CLI_MUX */
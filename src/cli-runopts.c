@@ -30,6 +30,8 @@
 #include "algo.h"
 #include "tcpfwd.h"
 #include "list.h"
+#include "mux.h"
+#include "fanout.h"
 
 cli_runopts cli_opts; /* GLOBAL */
 
@@ -96,6 +98,10 @@ static void printhelp() {
 					"-m <MAC list> Specify preferred MACs for packet verification (or '-m help')\n"
 #endif
 					"-b    [bind_address][:bind_port]\n"
+#if DROPBEAR_CLI_FANOUT
+					"-H <hostsfile> Run the command on each host listed, the hostname argument is omitted\n"
+					"-P <parallel> Hosts at once for -H (default %d)\n"
+#endif
 					"-V    Version\n"
 #if DEBUG_TRACE
 					"-v    verbose (repeat for more verbose)\n"
@@ -104,7 +110,11 @@ static void printhelp() {
 #if DROPBEAR_CLI_PUBKEY_AUTH
 					DROPBEAR_DEFAULT_CLI_AUTHKEY,
 #endif
-					DEFAULT_RECV_WINDOW, DEFAULT_KEEPALIVE, DEFAULT_IDLE_TIMEOUT);
+					DEFAULT_RECV_WINDOW, DEFAULT_KEEPALIVE, DEFAULT_IDLE_TIMEOUT
+#if DROPBEAR_CLI_FANOUT
+					, DEFAULT_FANOUT_PARALLEL
+#endif
+					);
 
 }
 
@@ -132,6 +142,9 @@ void cli_getopts(int argc, char ** argv) {
 
 	const char* recv_window_arg = NULL;
 	const char* idle_timeout_arg = NULL;
+#if DROPBEAR_CLI_FANOUT
+	const char* fanout_parallel_arg = NULL;
+#endif
 	const char *host_arg = NULL;
 	const char *proxycmd_arg = NULL;
 	const char *remoteport_arg = NULL;
@@ -176,6 +189,14 @@ void cli_getopts(int argc, char ** argv) {
 #endif
 #if DROPBEAR_CLI_PROXYCMD
 	cli_opts.proxycmd = NULL;
+#endif
+#if DROPBEAR_CLI_FANOUT
+	cli_opts.fanout_hosts = NULL;
+#endif
+#if DROPBEAR_CLI_MUX
+	cli_opts.control_path = NULL;
+	cli_opts.control_master = MUX_MASTER_NO;
+	cli_opts.control_persist = 0;
 #endif
 	cli_opts.bind_arg = NULL;
 	cli_opts.bind_address = NULL;
@@ -205,7 +226,12 @@ void cli_getopts(int argc, char ** argv) {
 		/* Handle non-flag arguments such as hostname or commands for the remote host */
 		if (argv[i][0] != '-')
 		{
-			if (host_arg == NULL) {
+			if (host_arg == NULL
+#if DROPBEAR_CLI_FANOUT
+				/* hosts come from the list instead */
+				&& cli_opts.fanout_hosts == NULL
+#endif
+				) {
 				host_arg = argv[i];
 				continue;
 			}
@@ -299,6 +325,14 @@ void cli_getopts(int argc, char ** argv) {
 				case 'I':
 					next = &idle_timeout_arg;
 					break;
+#if DROPBEAR_CLI_FANOUT
+				case 'H':
+					next = &cli_opts.fanout_hosts;
+					break;
+				case 'P':
+					next = &fanout_parallel_arg;
+					break;
+#endif
 #if DROPBEAR_CLI_AGENTFWD
 				case 'A':
 					cli_opts.agent_fwd = 1;
@@ -404,6 +438,22 @@ void cli_getopts(int argc, char ** argv) {
 	parse_ciphers_macs();
 #endif
 
+#if DROPBEAR_CLI_FANOUT
+	if (cli_opts.fanout_hosts) {
+		unsigned int parallel = DEFAULT_FANOUT_PARALLEL;
+		if (i >= (unsigned int)argc) {
+			dropbear_exit("Command required for -H");
+		}
+		if (fanout_parallel_arg
+			&& (m_str_to_uint(fanout_parallel_arg, &parallel) == DROPBEAR_FAILURE
+				|| parallel == 0)) {
+			dropbear_exit("Bad parallel '%s'", fanout_parallel_arg);
+		}
+		/* Carries on with a host in each child process */
+		host_arg = cli_fanout(cli_opts.fanout_hosts, parallel);
+	}
+#endif
+
 	if (host_arg == NULL) { /* missing hostname */
 		printhelp();
 		dropbear_exit("Remote host needs to provided.");
@@ -925,6 +975,11 @@ static void add_extendedopt(const char* origstr) {
 		dropbear_log(LOG_INFO, "Available options:\n"
 			"\tBatchMode\n"
 			"\tBindAddress\n"
+#if DROPBEAR_CLI_MUX
+			"\tControlMaster\n"
+			"\tControlPath\n"
+			"\tControlPersist\n"
+#endif
 			"\tDisableTrivialAuth\n"
 #if DROPBEAR_CLI_ANYTCPFWD
 			"\tExitOnForwardFailure\n"
@@ -962,6 +1017,36 @@ static void add_extendedopt(const char* origstr) {
 		return;
 	}
 
+#if DROPBEAR_CLI_MUX
+	if (match_extendedopt(&optstr, "ControlMaster") == DROPBEAR_SUCCESS) {
+		if (strcmp(optstr, "auto") == 0) {
+			cli_opts.control_master = MUX_MASTER_AUTO;
+		} else if (parse_flag_value(optstr)) {
+			cli_opts.control_master = MUX_MASTER_YES;
+		} else {
+			cli_opts.control_master = MUX_MASTER_NO;
+		}
+		return;
+	}
+
+	if (match_extendedopt(&optstr, "ControlPath") == DROPBEAR_SUCCESS) {
+		m_free(cli_opts.control_path);
+		if (strcmp(optstr, "none") != 0) {
+			cli_opts.control_path = expand_homedir_path(optstr);
+		}
+		return;
+	}
+
+	if (match_extendedopt(&optstr, "ControlPersist") == DROPBEAR_SUCCESS) {
+		if (strcmp(optstr, "yes") == 0 || strcmp(optstr, "no") == 0) {
+			cli_opts.control_persist = 0;
+		} else if (m_str_to_uint(optstr, &cli_opts.control_persist) == DROPBEAR_FAILURE) {
+			dropbear_exit("Bad ControlPersist '%s'", optstr);
+		}
+		return;
+	}
+#endif
+
 	if (match_extendedopt(&optstr, "DisableTrivialAuth") == DROPBEAR_SUCCESS) {
 		cli_opts.disable_trivial_auth = parse_flag_value(optstr);
 		return;
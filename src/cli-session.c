@@ -38,6 +38,7 @@
 #include "agentfwd.h"
 #include "crypto_desc.h"
 #include "netio.h"
+#include "mux.h"
 
 static void cli_remoteclosed(void) ATTRIB_NORETURN;
 static void cli_sessionloop(void);
@@ -168,7 +169,10 @@ static void cli_session_init(pid_t proxy_cmd_pid) {
 	TRACE(("proxy command PID='%d'", proxy_cmd_pid));
 
 	/* Auth */
-	cli_ses.lastprivkey = NULL;
+#if DROPBEAR_CLI_PUBKEY_AUTH
+	cli_ses.pubkey_nqueried = 0;
+	cli_ses.pubkey_signed = NULL;
+#endif
 	cli_ses.lastauthtype = 0;
 	cli_ses.is_trivial_auth = 1;
 
@@ -293,6 +297,10 @@ static void cli_sessionloop() {
 							errno, strerror(errno));
 				}
 			}
+
+#if DROPBEAR_CLI_MUX
+			cli_mux_master_listen();
+#endif
 			
 #if DROPBEAR_CLI_NETCAT
 			if (cli_opts.netcat_host) {
@@ -318,6 +326,11 @@ static void cli_sessionloop() {
 			if (ses.chancount < 1 && !cli_opts.no_cmd) {
 				cli_finished();
 			}
+#if DROPBEAR_CLI_MUX
+			if (cli_mux_persist_expired()) {
+				cli_finished();
+			}
+#endif
 
 			if (cli_ses.winchange) {
 				cli_chansess_winchange();
@@ -367,6 +380,9 @@ static void cli_session_cleanup(void) {
 	m_close(cli_ses.stderrcopy);
 
 	cli_tty_cleanup();
+#if DROPBEAR_CLI_MUX
+	cli_mux_cleanup();
+#endif
 	if (cli_ses.server_sig_algs) {
 		buf_free(cli_ses.server_sig_algs);
 	}
@@ -66,6 +66,11 @@ static void close_chan_fd(struct Channel *channel, int fd, int how);
  */
 #define RECV_MAX_CHANNEL_DATA_LEN (RECV_MAX_PAYLOAD_LEN-(1+4+4))
 
+/* Incoming data packets smaller than this are queued in the channel's
+ * buffer rather than written straight away, channelio() writes out
+ * everything that arrived during the loop iteration together */
+#define RECV_COALESCE_LEN 4096
+
 /* Initialise all the channels */
 void chaninitialise(const struct ChanType *chantypes[]) {
 
@@ -74,6 +79,10 @@ void chaninitialise(const struct ChanType *chantypes[]) {
 	ses.chansize = 1;
 	ses.channels[0] = NULL;
 	ses.chancount = 0;
+	ses.chanfree = (unsigned int*)m_malloc(sizeof(unsigned int));
+	ses.chanfree[0] = 0;
+	ses.chanfreecount = 1;
+	ses.chanfirst = ses.chanlast = NULL;
 
 	ses.chantypes = chantypes;
 
@@ -86,16 +95,13 @@ void chaninitialise(const struct ChanType *chantypes[]) {
 /* Clean up channels, freeing allocated memory */
 void chancleanup() {
 
-	unsigned int i;
-
 	TRACE(("enter chancleanup"))
-	for (i = 0; i < ses.chansize; i++) {
-		if (ses.channels[i] != NULL) {
-			TRACE(("channel %d closing", i))
-			remove_channel(ses.channels[i]);
-		}
+	while (ses.chanfirst != NULL) {
+		TRACE(("channel %d closing", ses.chanfirst->index))
+		remove_channel(ses.chanfirst);
 	}
 	m_free(ses.channels);
+	m_free(ses.chanfree);
 	TRACE(("leave chancleanup"))
 }
 
@@ -108,36 +114,37 @@ static struct Channel* newchannel(unsigned int remotechan,
 		unsigned int transwindow, unsigned int transmaxpacket) {
 
 	struct Channel * newchan;
-	unsigned int i, j;
+	unsigned int i, newsize;
 
 	TRACE(("enter newchannel"))
 	
-	/* first see if we can use existing channels */
-	for (i = 0; i < ses.chansize; i++) {
-		if (ses.channels[i] == NULL) {
-			break;
-		}
-	}
-
-	/* otherwise extend the list */
-	if (i == ses.chansize) {
+	/* extend the list if there are no free slots */
+	if (ses.chanfreecount == 0) {
 		if (ses.chansize >= MAX_CHANNELS) {
 			TRACE(("leave newchannel: max chans reached"))
 			return NULL;
 		}
 
-		/* extend the channels */
-		ses.channels = (struct Channel**)m_realloc(ses.channels,
-				(ses.chansize+CHAN_EXTEND_SIZE)*sizeof(struct Channel*));
-
-		ses.chansize += CHAN_EXTEND_SIZE;
+		/* doubling keeps the copying linear with many channels */
+		newsize = MAX(ses.chansize*2, ses.chansize+CHAN_EXTEND_SIZE);
+		newsize = MIN(newsize, MAX_CHANNELS);
 
-		/* set the new channels to null */
-		for (j = i; j < ses.chansize; j++) {
-			ses.channels[j] = NULL;
+		ses.channels = (struct Channel**)m_realloc(ses.channels,
+				newsize*sizeof(struct Channel*));
+		ses.chanfree = (unsigned int*)m_realloc(ses.chanfree,
+				newsize*sizeof(unsigned int));
+
+		/* set the new channels to null. Pushed highest first so that the
+		 * lowest index is used first */
+		for (i = newsize; i > ses.chansize; i--) {
+			ses.channels[i-1] = NULL;
+			ses.chanfree[ses.chanfreecount++] = i-1;
 		}
-
+		ses.chansize = newsize;
 	}
+
+	i = ses.chanfree[--ses.chanfreecount];
+	dropbear_assert(ses.channels[i] == NULL);
 	
 	newchan = (struct Channel*)m_malloc(sizeof(struct Channel));
 	newchan->type = type;
@@ -153,7 +160,9 @@ static struct Channel* newchannel(unsigned int remotechan,
 	newchan->writefd = FD_UNINIT;
 	newchan->readfd = FD_UNINIT;
 	newchan->errfd = FD_CLOSED; /* this isn't always set to start with */
+	newchan->exitfd = -1;
 	newchan->await_open = 0;
+	newchan->write_deferred = 0;
 
 	newchan->writebuf = cbuf_new(opts.recv_window);
 	newchan->recvwindow = opts.recv_window;
@@ -167,6 +176,15 @@ static struct Channel* newchannel(unsigned int remotechan,
 	ses.channels[i] = newchan;
 	ses.chancount++;
 
+	newchan->chan_next = NULL;
+	newchan->chan_prev = ses.chanlast;
+	if (ses.chanlast) {
+		ses.chanlast->chan_next = newchan;
+	} else {
+		ses.chanfirst = newchan;
+	}
+	ses.chanlast = newchan;
+
 	TRACE(("leave newchannel"))
 
 	return newchan;
@@ -199,19 +217,15 @@ struct Channel* getchannel() {
 void channelio(const fd_set *readfds, const fd_set *writefds) {
 
 	/* Listeners such as TCP, X11, agent-auth */
-	struct Channel *channel;
-	unsigned int i;
+	struct Channel *channel, *next;
 
 	/* foreach channel */
-	for (i = 0; i < ses.chansize; i++) {
+	for (channel = ses.chanfirst; channel != NULL; channel = next) {
 		/* Close checking only needs to occur for channels that had IO events */
 		int do_check_close = 0;
 
-		channel = ses.channels[i];
-		if (channel == NULL) {
-			/* only process in-use channels */
-			continue;
-		}
+		/* check_close() may remove the channel */
+		next = channel->chan_next;
 
 		/* read data and send it over the wire */
 		if (channel->readfd >= 0 && FD_ISSET(channel->readfd, readfds)) {
@@ -229,17 +243,26 @@ void channelio(const fd_set *readfds, const fd_set *writefds) {
 		}
 
 		/* write to program/pipe stdin */
-		if (channel->writefd >= 0 && FD_ISSET(channel->writefd, writefds)) {
+		if (channel->writefd >= 0 
+			&& (channel->write_deferred || FD_ISSET(channel->writefd, writefds))) {
 			writechannel(channel, channel->writefd, channel->writebuf, NULL, NULL);
 			do_check_close = 1;
 		}
 		
 		/* stderr for client mode */
-		if (ERRFD_IS_WRITE(channel)
-				&& channel->errfd >= 0 && FD_ISSET(channel->errfd, writefds)) {
+		if (ERRFD_IS_WRITE(channel) && channel->errfd >= 0 
+			&& (channel->write_deferred || FD_ISSET(channel->errfd, writefds))) {
 			writechannel(channel, channel->errfd, channel->extrabuf, NULL, NULL);
 			do_check_close = 1;
 		}
+		channel->write_deferred = 0;
+
+		/* the process behind the channel has exited */
+		if (channel->exitfd >= 0 && FD_ISSET(channel->exitfd, readfds)) {
+			TRACE(("exitfd %d set", channel->exitfd))
+			channel->exitfd = -1;
+			do_check_close = 1;
+		}
 
 		if (ses.channel_signal_pending) {
 			/* SIGCHLD can change channel state for server sessions */
@@ -541,15 +564,9 @@ static int writechannel(struct Channel* channel, int fd, circbuffer *cbuf,
  * This avoid channels which don't have any window available, are closed, etc*/
 void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads) {
 	
-	unsigned int i;
 	struct Channel * channel;
 	
-	for (i = 0; i < ses.chansize; i++) {
-
-		channel = ses.channels[i];
-		if (channel == NULL) {
-			continue;
-		}
+	for (channel = ses.chanfirst; channel != NULL; channel = channel->chan_next) {
 
 		/* Stuff to put over the wire. 
 		Avoid queueing data to send if we're in the middle of a 
@@ -578,6 +595,10 @@ void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads) {
 				FD_SET(channel->errfd, writefds);
 		}
 
+		if (channel->exitfd >= 0) {
+			FD_SET(channel->exitfd, readfds);
+		}
+
 	} /* foreach channel */
 
 #if DROPBEAR_LISTENERS
@@ -655,7 +676,19 @@ static void remove_channel(struct Channel * channel) {
 		cancel_connect(channel->conn_pending);
 	}
 
+	if (channel->chan_prev) {
+		channel->chan_prev->chan_next = channel->chan_next;
+	} else {
+		ses.chanfirst = channel->chan_next;
+	}
+	if (channel->chan_next) {
+		channel->chan_next->chan_prev = channel->chan_prev;
+	} else {
+		ses.chanlast = channel->chan_prev;
+	}
+
 	ses.channels[channel->index] = NULL;
+	ses.chanfree[ses.chanfreecount++] = channel->index;
 	m_free(channel);
 	ses.chancount--;
 
@@ -823,12 +856,20 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 	channel->recvwindow -= datalen;
 	dropbear_assert(channel->recvwindow <= opts.recv_window);
 
-	/* Attempt to write the data immediately without having to put it in the circular buffer */
-	consumed = datalen;
-	res = writechannel(channel, fd, cbuf, buf_getptr(ses.payload, datalen), &consumed);
+	if (datalen < RECV_COALESCE_LEN && channel->prio != DROPBEAR_PRIO_LOWDELAY) {
+		/* Small packets often come in bursts (session_loop() handles
+		 * several per iteration), they get written in one go by channelio().
+		 * Interactive sessions are still written immediately. */
+		channel->write_deferred = 1;
+		res = DROPBEAR_SUCCESS;
+	} else {
+		/* Attempt to write the data immediately without having to put it in the circular buffer */
+		consumed = datalen;
+		res = writechannel(channel, fd, cbuf, buf_getptr(ses.payload, datalen), &consumed);
 
-	datalen -= consumed;
-	buf_incrpos(ses.payload, consumed);
+		datalen -= consumed;
+		buf_incrpos(ses.payload, consumed);
+	}
 
 
 	/* We may have to run throught twice, if the buffer wraps around. Can't
@@ -1197,14 +1238,9 @@ void send_msg_request_failure() {
 }
 
 struct Channel* get_any_ready_channel() {
-	size_t i;
-	if (ses.chancount == 0) {
-		return NULL;
-	}
-	for (i = 0; i < ses.chansize; i++) {
-		struct Channel *chan = ses.channels[i];
-		if (chan
-				&& !(chan->sent_eof || chan->recv_eof)
+	struct Channel *chan;
+	for (chan = ses.chanfirst; chan != NULL; chan = chan->chan_next) {
+		if (!(chan->sent_eof || chan->recv_eof)
 				&& !(chan->await_open)) {
 			return chan;
 		}
@@ -444,20 +444,28 @@ static void gen_new_zstream_recv() {
 	}
 }
 
+/* Negative windowbits gives a raw stream without the zlib header */
+static z_streamp new_zstream_trans(int windowbits) {
+	z_streamp zstream;
+
+	zstream = (z_streamp)m_malloc(sizeof(z_stream));
+	zstream->zalloc = dropbear_zalloc;
+	zstream->zfree = dropbear_zfree;
+
+	if (deflateInit2(zstream, Z_DEFAULT_COMPRESSION,
+				Z_DEFLATED, windowbits,
+				DROPBEAR_ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY)
+			!= Z_OK) {
+		dropbear_exit("zlib error");
+	}
+	return zstream;
+}
+
 static void gen_new_zstream_trans() {
 
 	if (ses.newkeys->trans.algo_comp == DROPBEAR_COMP_ZLIB
 			|| ses.newkeys->trans.algo_comp == DROPBEAR_COMP_ZLIB_DELAY) {
-		ses.newkeys->trans.zstream = (z_streamp)m_malloc(sizeof(z_stream));
-		ses.newkeys->trans.zstream->zalloc = dropbear_zalloc;
-		ses.newkeys->trans.zstream->zfree = dropbear_zfree;
-	
-		if (deflateInit2(ses.newkeys->trans.zstream, Z_DEFAULT_COMPRESSION,
-					Z_DEFLATED, DROPBEAR_ZLIB_WINDOW_BITS, 
-					DROPBEAR_ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY)
-				!= Z_OK) {
-			dropbear_exit("zlib error");
-		}
+		ses.newkeys->trans.zstream = new_zstream_trans(DROPBEAR_ZLIB_WINDOW_BITS);
 	} else {
 		ses.newkeys->trans.zstream = NULL;
 	}
@@ -470,6 +478,37 @@ static void gen_new_zstream_trans() {
 		m_free(ses.keys->trans.zstream);
 	}
 }
+
+#if DROPBEAR_ZLIB_IDLE_RELEASE
+/* Frees the compressor's state while the connection is idle. Each packet
+ * is compressed with Z_SYNC_FLUSH so nothing is left pending, and the
+ * peer's decompressor doesn't need it: a new compressor continues the
+ * stream with blocks that only refer back to data it has sent itself. */
+void release_zstream_trans() {
+	z_streamp zstream = ses.keys->trans.zstream;
+
+	/* before the first packet the zlib header hasn't been sent, keep
+	 * it simple and wait until it has */
+	if (zstream == NULL || zstream->total_out == 0) {
+		return;
+	}
+	TRACE(("releasing idle compression state"))
+	(void)deflateEnd(zstream);
+	m_free(ses.keys->trans.zstream);
+	ses.keys->trans.zstream_released = 1;
+#ifdef HAVE_MALLOC_TRIM
+	/* the buffers are freed amongst others on the heap */
+	malloc_trim(0);
+#endif
+}
+
+void resume_zstream_trans() {
+	TRACE(("resuming compression"))
+	/* the zlib header was sent at the start of the stream */
+	ses.keys->trans.zstream = new_zstream_trans(-DROPBEAR_ZLIB_WINDOW_BITS);
+	ses.keys->trans.zstream_released = 0;
+}
+#endif
 #endif /* DISABLE_ZLIB */
 
 
@@ -35,6 +35,7 @@
 #include "channel.h"
 #include "runopts.h"
 #include "netio.h"
+#include "resolve.h"
 
 static void checktimeouts(void);
 static long select_timeout(void);
@@ -43,6 +44,10 @@ static void read_session_identification(void);
 
 struct sshsession ses; /* GLOBAL */
 
+/* Packets handled per main loop iteration when they arrive faster than
+ * they can be processed. Bounded so that channels keep being serviced */
+#define MAX_PACKETS_PER_LOOP 16
+
 /* called only at the start of a session, set up initial state */
 void common_session_init(int sock_in, int sock_out) {
 	time_t now;
@@ -162,6 +167,7 @@ void session_loop(void(*loophandler)(void)) {
 	fd_set readfd, writefd;
 	struct timeval timeout;
 	int val;
+	unsigned int npackets;
 
 	/* main loop, select()s for all sockets in use */
 	for(;;) {
@@ -186,8 +192,12 @@ void session_loop(void(*loophandler)(void)) {
 		/* set up for channels which can be read/written */
 		setchannelfds(&readfd, &writefd, writequeue_has_space);
 
+		/* Name lookups, before connections so that answers
+		 * already known get connected straight away */
+		set_resolve_fds(&readfd);
+
 		/* Pending connections to test */
-		set_connect_fds(&writefd);
+		set_connect_fds(&writefd, &timeout);
 
 		/* We delay reading from the input socket during initial setup until
 		after we have written out our initial KEXINIT packet (empty writequeue). 
@@ -252,9 +262,20 @@ void session_loop(void(*loophandler)(void)) {
 			}
 			
 			/* Process the decrypted packet. After this, the read buffer
-			 * will be ready for a new packet */
-			if (ses.payload != NULL) {
+			 * will be ready for a new packet. Channel data that has
+			 * already arrived is handled in the same pass, up to a limit.
+			 * Other packets get a loophandler() call each, the client
+			 * and server state machines look at ses.lastpacket */
+			for (npackets = 0; ses.payload != NULL; npackets++) {
 				process_packet();
+				if ((ses.lastpacket != SSH_MSG_CHANNEL_DATA
+						&& ses.lastpacket != SSH_MSG_CHANNEL_EXTENDED_DATA)
+					|| npackets+1 >= MAX_PACKETS_PER_LOOP
+					|| ses.sock_in == -1
+					|| ses.writequeue_len > 2*TRANS_MAX_PAYLOAD_LEN) {
+					break;
+				}
+				read_packet();
 			}
 		}
 
@@ -262,6 +283,7 @@ void session_loop(void(*loophandler)(void)) {
 		were being held up during a KEX */
 		maybe_flush_reply_queue();
 
+		handle_resolve_fds(&readfd);
 		handle_connect_fds(&writefd);
 
 		/* loop handler prior to channelio, in case the server loophandler closes
@@ -319,6 +341,7 @@ void session_cleanup() {
 	remove_all_listeners();
 
 	remove_connect_pending();
+	remove_resolve_pending();
 
 	while (!isempty(&ses.writequeue)) {
 		buf_free(dequeue(&ses.writequeue));
@@ -339,6 +362,7 @@ void session_cleanup() {
 	m_free(ses.authstate.pw_name);
 	m_free(ses.authstate.pw_shell);
 	m_free(ses.authstate.pw_passwd);
+	m_free(ses.authstate.pw_groups);
 	m_free(ses.authstate.username);
 #endif
 
@@ -581,6 +605,13 @@ static void checktimeouts() {
 			&& elapsed(now, ses.last_packet_time_idle) >= opts.idle_timeout_secs) {
 		dropbear_close("Idle timeout");
 	}
+
+#if !defined(DISABLE_ZLIB) && DROPBEAR_ZLIB_IDLE_RELEASE
+	if (ses.keys->trans.zstream
+			&& elapsed(now, ses.last_packet_time_any_sent) >= DROPBEAR_ZLIB_IDLE_RELEASE) {
+		release_zstream_trans();
+	}
+#endif
 }
 
 static void update_timeout(long limit, time_t now, time_t last_event, long * timeout) {
@@ -618,6 +649,20 @@ static long select_timeout() {
 	update_timeout(opts.idle_timeout_secs, now, ses.last_packet_time_idle,
 		&timeout);
 
+#if !defined(DISABLE_ZLIB) && DROPBEAR_ZLIB_IDLE_RELEASE
+	if (ses.keys->trans.zstream) {
+		update_timeout(DROPBEAR_ZLIB_IDLE_RELEASE, now, ses.last_packet_time_any_sent,
+			&timeout);
+	}
+#endif
+
+	if (ses.extra_select_timeout) {
+		long extra = ses.extra_select_timeout(now);
+		if (extra >= 0) {
+			timeout = MIN(timeout, extra);
+		}
+	}
+
 	/* clamp negative timeouts to zero - event has already triggered */
 	return MAX(timeout, 0);
 }
@@ -631,7 +676,11 @@ const char* get_user_shell() {
 	}
 }
 void fill_passwd(const char* username) {
-	struct passwd *pw = NULL;
+	fill_passwd_entry(getpwnam(username));
+}
+
+/* As fill_passwd(), for an entry that has already been looked up */
+void fill_passwd_entry(const struct passwd *pw) {
 	if (ses.authstate.pw_name)
 		m_free(ses.authstate.pw_name);
 	if (ses.authstate.pw_dir)
@@ -641,7 +690,6 @@ void fill_passwd(const char* username) {
 	if (ses.authstate.pw_passwd)
 		m_free(ses.authstate.pw_passwd);
 
-	pw = getpwnam(username);
 	if (!pw) {
 		return;
 	}
@@ -677,7 +725,7 @@ void fill_passwd(const char* username) {
 void update_channel_prio() {
 	enum dropbear_prio new_prio;
 	int any = 0;
-	unsigned int i;
+	struct Channel *channel;
 
 	TRACE(("update_channel_prio"))
 
@@ -687,11 +735,7 @@ void update_channel_prio() {
 	}
 
 	new_prio = DROPBEAR_PRIO_NORMAL;
-	for (i = 0; i < ses.chansize; i++) {
-		struct Channel *channel = ses.channels[i];
-		if (!channel) {
-			continue;
-		}
+	for (channel = ses.chanfirst; channel != NULL; channel = channel->chan_next) {
 		any = 1;
 		if (channel->prio == DROPBEAR_PRIO_LOWDELAY) {
 			new_prio = DROPBEAR_PRIO_LOWDELAY;
@@ -266,6 +266,21 @@ int connect_unix(const char* path) {
 }
 #endif
 
+/* pipe() with close-on-exec set on both ends where it's supported. Children
+ * dup2() the ends they need onto stdin/stdout/stderr, those copies don't
+ * inherit the flag. */
+static int pipe_cloexec(int fds[2]) {
+#ifdef HAVE_PIPE2
+	if (pipe2(fds, O_CLOEXEC) == 0) {
+		return 0;
+	}
+	if (errno != ENOSYS) {
+		return -1;
+	}
+#endif
+	return pipe(fds);
+}
+
 /* Sets up a pipe for a, returning three non-blocking file descriptors
  * and the pid. exec_fn is the function that will actually execute the child process,
  * it will be run after the child has fork()ed, and is passed exec_data.
@@ -288,13 +303,13 @@ int spawn_command(void(*exec_fn)(const void *user_data), const void *exec_data,
 #endif
 
 	/* redirect stdin/stdout/stderr */
-	if (pipe(infds) != 0) {
+	if (pipe_cloexec(infds) != 0) {
 		return DROPBEAR_FAILURE;
 	}
-	if (pipe(outfds) != 0) {
+	if (pipe_cloexec(outfds) != 0) {
 		return DROPBEAR_FAILURE;
 	}
-	if (ret_errfd && pipe(errfds) != 0) {
+	if (ret_errfd && pipe_cloexec(errfds) != 0) {
 		return DROPBEAR_FAILURE;
 	}
 
@@ -365,13 +380,40 @@ int spawn_command(void(*exec_fn)(const void *user_data), const void *exec_data,
 	}
 }
 
+/* Close file descriptors from lowfd upwards. maxfd is the highest that could
+ * be open, close_range() doesn't need it */
+void close_fds_from(unsigned int lowfd, unsigned int maxfd) {
+	unsigned int i;
+
+#ifdef HAVE_CLOSE_RANGE
+	if (close_range(lowfd, ~0U, 0) == 0) {
+		return;
+	}
+	/* ENOSYS with older kernels, fall back to closing individually */
+#endif
+	for (i = lowfd; i <= maxfd; i++) {
+		m_close(i);
+	}
+}
+
+/* Common setup prior to exec of a child command */
+static void prepare_child_exec(unsigned int maxfd) {
+	/* Re-enable SIGPIPE for the executed process */
+	if (signal(SIGPIPE, SIG_DFL) == SIG_ERR) {
+		dropbear_exit("signal() error");
+	}
+
+	/* close file descriptors except stdin/stdout/stderr
+	 * Need to be sure FDs are closed here to avoid reading files as root */
+	close_fds_from(3, maxfd);
+}
+
 /* Runs a command with "sh -c". Will close FDs (except stdin/stdout/stderr) and
  * re-enabled SIGPIPE. If cmd is NULL, will run a login shell.
  */
 void run_shell_command(const char* cmd, unsigned int maxfd, char* usershell) {
 	char * argv[4];
 	char * baseshell = NULL;
-	unsigned int i;
 
 	baseshell = basename(usershell);
 
@@ -393,19 +435,98 @@ void run_shell_command(const char* cmd, unsigned int maxfd, char* usershell) {
 		argv[1] = NULL;
 	}
 
-	/* Re-enable SIGPIPE for the executed process */
-	if (signal(SIGPIPE, SIG_DFL) == SIG_ERR) {
-		dropbear_exit("signal() error");
+	prepare_child_exec(maxfd);
+
+	execv(usershell, argv);
+}
+
+#if DROPBEAR_SVR_DIRECT_EXEC
+/* Shells where "sh -c cmd" for a plain command is equivalent to
+ * executing it directly. Anything else (git-shell, rbash etc) must
+ * always be run through the shell */
+static const char * const direct_exec_shells[] = {
+	"sh", "bash", "dash", "ash", "ksh", "mksh", "zsh", NULL
+};
+
+/* Builtins and reserved words that can't be found with execvp(), or that
+ * behave differently as a separate process */
+static const char * const direct_exec_builtins[] = {
+	".", ":", "alias", "break", "case", "cd", "command", "continue",
+	"do", "done", "elif", "else", "esac", "eval", "exec", "exit", "export",
+	"fi", "for", "function", "if", "read", "readonly", "return", "select",
+	"set", "shift", "source", "then", "time", "times", "trap", "ulimit",
+	"umask", "unalias", "unset", "until", "wait", "while", NULL
+};
+
+static int in_list(const char * const *list, const char *s) {
+	unsigned int i;
+	for (i = 0; list[i] != NULL; i++) {
+		if (strcmp(list[i], s) == 0) {
+			return 1;
+		}
 	}
+	return 0;
+}
 
-	/* close file descriptors except stdin/stdout/stderr
-	 * Need to be sure FDs are closed here to avoid reading files as root */
-	for (i = 3; i <= maxfd; i++) {
-		m_close(i);
+/* Returns 1 if cmd only contains characters that the shell would pass
+ * through unchanged as words separated by spaces */
+static int is_plain_command(const char *cmd) {
+	const char *c;
+
+	if (cmd[0] == '\0') {
+		return 0;
 	}
+	for (c = cmd; *c != '\0'; c++) {
+		if (isalnum((unsigned char)*c) || *c == ' ' || *c == '\t') {
+			continue;
+		}
+		if (strchr("-_./,:=+@%", *c) == NULL) {
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	execv(usershell, argv);
+/* As for run_shell_command(), but a simple command is executed directly
+ * without an intermediate shell process. Falls back to run_shell_command()
+ * if the command needs shell interpretation or can't be executed directly. */
+void run_direct_command(const char* cmd, unsigned int maxfd, char* usershell) {
+	char ** argv = NULL;
+	char * cmdcopy = NULL;
+	char * word = NULL;
+	unsigned int argc = 0, maxargs;
+
+	if (cmd == NULL
+		|| !in_list(direct_exec_shells, basename(usershell))
+		|| !is_plain_command(cmd)) {
+		run_shell_command(cmd, maxfd, usershell);
+		return;
+	}
+
+	/* at most one word per two characters */
+	maxargs = strlen(cmd) / 2 + 2;
+	argv = m_malloc(sizeof(char*) * maxargs);
+	cmdcopy = m_strdup(cmd);
+	for (word = strtok(cmdcopy, " \t"); word; word = strtok(NULL, " \t")) {
+		argv[argc++] = word;
+	}
+	argv[argc] = NULL;
+
+	if (argc > 0
+		/* "VAR=value cmd" is an assignment */
+		&& strchr(argv[0], '=') == NULL
+		&& !in_list(direct_exec_builtins, argv[0])) {
+		prepare_child_exec(maxfd);
+		execvp(argv[0], argv);
+		TRACE(("direct exec of '%s' failed: %s", argv[0], strerror(errno)))
+	}
+
+	/* Let the shell handle it, including reporting errors */
+	m_free(argv);
+	m_free(cmdcopy);
+	run_shell_command(cmd, maxfd, usershell);
 }
+#endif /* DROPBEAR_SVR_DIRECT_EXEC */
 
 #if DEBUG_TRACE
 void printhex(const char * label, const unsigned char * buf, int len) {
@@ -63,6 +63,10 @@ char * stripcontrol(const char * text);
 int spawn_command(void(*exec_fn)(const void *user_data), const void *exec_data,
 		int *writefd, int *readfd, int *errfd, pid_t *pid);
 void run_shell_command(const char* cmd, unsigned int maxfd, char* usershell);
+void close_fds_from(unsigned int lowfd, unsigned int maxfd);
+#if DROPBEAR_SVR_DIRECT_EXEC
+void run_direct_command(const char* cmd, unsigned int maxfd, char* usershell);
+#endif
 #if ENABLE_CONNECT_UNIX
 int connect_unix(const char* addr);
 #endif
@@ -90,6 +90,19 @@ IMPORTANT: Some options will require "make clean" after changes */
  * to a remote TCP-forwarded connection */
 #define DROPBEAR_CLI_NETCAT 1
 
+/* Allow "-o ControlMaster" and "-o ControlPath", so that later dbclient
+ * invocations run their commands over an existing connection */
+#define DROPBEAR_CLI_MUX 1
+
+/* Allow "-H hostsfile" to run a command on many hosts from one dbclient,
+ * up to DEFAULT_FANOUT_PARALLEL at a time unless -P is given */
+#define DROPBEAR_CLI_FANOUT 1
+#define DEFAULT_FANOUT_PARALLEL 32
+
+/* Keep an index of a large ~/.ssh/known_hosts in known_hosts.idx, so host
+ * key checks don't have to read through the whole file */
+#define DROPBEAR_CLI_KNOWNHOSTS_INDEX 1
+
 /* Whether to support "-c" and "-m" flags to choose ciphers/MACs at runtime */
 #define DROPBEAR_USER_ALGO_LIST 1
 
@@ -218,7 +231,13 @@ group1 in Dropbear server too */
  * interoperability) */
 #define DROPBEAR_ZLIB_WINDOW_BITS 15
 
-/* Whether to do reverse DNS lookups. */
+/* Free the compression state of a connection that hasn't sent anything
+ * for this many seconds, it's set up again for the next packet. This saves
+ * the 256kB above for each idle connection. 0 keeps it */
+#define DROPBEAR_ZLIB_IDLE_RELEASE 30
+
+/* Whether to do reverse DNS lookups. The lookup runs in the background,
+ * the address is logged until it has finished. */
 #define DO_HOST_LOOKUP 0
 
 /* Whether to print the message of the day (MOTD). */
@@ -280,6 +299,12 @@ group1 in Dropbear server too */
  since it could cause problems with non-compliant servers */
 #define DROPBEAR_CLI_IMMEDIATE_AUTH 0
 
+/* With DROPBEAR_CLI_IMMEDIATE_AUTH, dbclient also sends queries for up to
+ * this many public keys at once rather than waiting a roundtrip for the reply
+ * to each one. Servers count every key queried towards their limit
+ * of attempts (MaxAuthTries for OpenSSH), so don't make it too large */
+#define DROPBEAR_CLI_PUBKEY_PIPELINE 4
+
 /* Set this to use PRNGD or EGD instead of /dev/urandom */
 #define DROPBEAR_USE_PRNGD 0
 #define DROPBEAR_PRNGD_SOCKET "/var/run/dropbear-rng"
@@ -326,6 +351,24 @@ group1 in Dropbear server too */
  * not using the Dropbear client, you'll need to change it */
 #define DROPBEAR_PATH_SSH_PROGRAM "/usr/bin/dbclient"
 
+/* Execute simple commands (no quoting, variables, redirection etc) directly
+ * rather than through "sh -c". This saves a process startup per exec request,
+ * but the user's shell startup files won't be run for those commands.
+ * Only used when the user's login shell is a standard Bourne-style shell. */
+#define DROPBEAR_SVR_DIRECT_EXEC 0
+
+/* Seconds that the listening server caches passwd entries and group lists
+ * for the sessions it spawns. Each session looks a user up once, asking the
+ * listener, which saves repeated queries to slow LDAP/SSSD backends.
+ * Set to 0 to have each session do its own lookup */
+#define DROPBEAR_SVR_PWCACHE_TTL 10
+
+/* Write utmp/wtmp/lastlog records from a single helper process forked by the
+ * listener, rather than inline during pty setup and teardown. Records that
+ * arrive together are written as a batch, skipping utmp and lastlog updates
+ * that a later record replaces. Not used in inetd mode */
+#define DROPBEAR_SVR_LOGINREC_WRITER 0
+
 /* Whether to log commands executed by a client. This only logs the
  * (single) command sent to the server, not what a user did in a
  * shell/sftp session etc. */
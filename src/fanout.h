@@ -0,0 +1,19 @@
+#ifndef DROPBEAR_FANOUT_H
+#define DROPBEAR_FANOUT_H
+
+#include "includes.h"
+
+#if DROPBEAR_CLI_FANOUT
+
+/* Runs the command on each host listed in hostsfile ("-" for stdin), with
+ * up to parallel connections at a time. The options have been parsed and
+ * identity keys loaded already, so a forked child process for each host
+ * carries on with them.
+ * Returns the host to connect to in a child. In the parent it doesn't
+ * return, output from each host is written prefixed by its name and the
+ * exit status is the highest from any host. */
+const char* cli_fanout(const char *hostsfile, unsigned int parallel);
+
+#endif /* DROPBEAR_CLI_FANOUT */
+
+#endif /* DROPBEAR_FANOUT_H */
@@ -131,6 +131,14 @@
 #include <sys/prctl.h>
 #endif
 
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
+#ifdef HAVE_SYS_PIDFD_H
+#include <sys/pidfd.h>
+#endif
+
 #ifdef BUNDLED_LIBTOM
 #include "../libtomcrypt/src/headers/tomcrypt.h"
 #include "../libtommath/tommath.h"
@@ -60,6 +60,10 @@ void kexcurve25519_comb_key(const struct kex_curve25519_param *param, const buff
 #ifndef DISABLE_ZLIB
 int is_compress_trans(void);
 int is_compress_recv(void);
+#if !defined(DISABLE_ZLIB) && DROPBEAR_ZLIB_IDLE_RELEASE
+void release_zstream_trans(void);
+void resume_zstream_trans(void);
+#endif
 #endif
 
 void recv_msg_kexdh_init(void); /* server */
@@ -0,0 +1,28 @@
+#ifndef DROPBEAR_KNOWNHOSTS_H
+#define DROPBEAR_KNOWNHOSTS_H
+
+#include "includes.h"
+
+#define MAX_KNOWNHOSTS_LINE 4500
+
+/* An index of ~/.ssh/known_hosts by hostname, kept next to it in
+ * known_hosts.idx so that a large file doesn't have to be read through for
+ * each connection. The index records the size, mtime and inode of
+ * known_hosts and is rebuilt when they change, so editing the file by hand
+ * is fine. */
+
+struct knownhosts_index;
+
+/* Returns NULL if known_hosts is small or the index can't be used, the
+ * caller reads through hostsfile itself then */
+struct knownhosts_index* knownhosts_index_open(const char *filename, FILE *hostsfile);
+/* Returns the number of lines that might be for host. *offsets is set
+ * to their positions in file order, to be freed with m_free() */
+unsigned int knownhosts_index_lookup(const struct knownhosts_index *idx,
+	const char *host, unsigned int hostlen, long **offsets);
+/* Adds a line that has just been appended at offset */
+void knownhosts_index_add(struct knownhosts_index *idx, FILE *hostsfile,
+	const char *host, unsigned int hostlen, long offset);
+void knownhosts_index_close(struct knownhosts_index *idx);
+
+#endif /* DROPBEAR_KNOWNHOSTS_H */
@@ -157,6 +157,7 @@
 #include "loginrec.h"
 #include "dbutil.h"
 #include "atomicio.h"
+#include "session.h"
 
 /**
  ** prototypes for helper functions in this file
@@ -182,6 +183,15 @@ int syslogin_write_entry(struct logininfo *li);
 int wtmp_get_entry(struct logininfo *li);
 int wtmpx_get_entry(struct logininfo *li);
 
+static void login_write_records(struct logininfo *lis, int count);
+
+#if DROPBEAR_SVR_LOGINREC_WRITER
+int login_writer_fd = -1;
+
+/* Most records the writer process takes in one go */
+#define LOGIN_WRITER_BATCH 64
+#endif
+
 /* pick the shortest string */
 #define MIN_SIZEOF(s1,s2) ( sizeof(s1) < sizeof(s2) ? sizeof(s1) : sizeof(s2) )
 
@@ -275,11 +285,17 @@ login_init_entry(struct logininfo *li, int pid, const char *username,
 
 	if (username) {
 		strlcpy(li->username, username, sizeof(li->username));
-		pw = getpwnam(li->username);
-		if (pw == NULL)
-			dropbear_exit("login_init_entry: Cannot find user \"%s\"",
-					li->username);
-		li->uid = pw->pw_uid;
+		if (ses.authstate.pw_name
+				&& strcmp(ses.authstate.pw_name, username) == 0) {
+			/* already looked up during auth */
+			li->uid = ses.authstate.pw_uid;
+		} else {
+			pw = getpwnam(li->username);
+			if (pw == NULL)
+				dropbear_exit("login_init_entry: Cannot find user \"%s\"",
+						li->username);
+			li->uid = pw->pw_uid;
+		}
 	}
 
 	if (hostname)
@@ -320,28 +336,117 @@ login_write (struct logininfo *li)
 
 	/* set the timestamp */
 	login_set_current_time(li);
+
+#if DROPBEAR_SVR_LOGINREC_WRITER
+	/* Leave it to the writer process. If its queue is full or it has
+	 * gone away the record is written here instead */
+	if (login_writer_fd >= 0
+			&& send(login_writer_fd, li, sizeof(*li), MSG_DONTWAIT)
+				== (ssize_t)sizeof(*li)) {
+		return 0;
+	}
+#endif
+
+	login_write_records(li, 1);
+	return 0;
+}
+
+#if defined(USE_LASTLOG) || defined(USE_UTMP) || defined(USE_UTMPX)
+/* Whether a later record in the batch replaces lis[i]. utmp only holds
+ * the latest state of each line, and lastlog the latest login of a uid */
+static int
+login_superseded(const struct logininfo *lis, int count, int i, int by_uid)
+{
+	int j;
+
+	for (j = i + 1; j < count; j++) {
+		if (by_uid) {
+			if (lis[j].type == LTYPE_LOGIN && lis[j].uid == lis[i].uid)
+				return 1;
+		} else if (strncmp(lis[j].line, lis[i].line, sizeof(lis[i].line)) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/* Write out timestamped records, in order. wtmp gets every one of them,
+ * superseded utmp and lastlog writes are skipped */
+static void
+login_write_records(struct logininfo *lis, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct logininfo *li = &lis[i];
 #ifdef USE_LOGIN
-	syslogin_write_entry(li);
+		syslogin_write_entry(li);
 #endif
 #ifdef USE_LASTLOG
-	if (li->type == LTYPE_LOGIN) {
-		lastlog_write_entry(li);
-	}
+		if (li->type == LTYPE_LOGIN && !login_superseded(lis, count, i, 1)) {
+			lastlog_write_entry(li);
+		}
 #endif
 #ifdef USE_UTMP
-	utmp_write_entry(li);
+		if (!login_superseded(lis, count, i, 0)) {
+			utmp_write_entry(li);
+		}
 #endif
 #ifdef USE_WTMP
-	wtmp_write_entry(li);
+		wtmp_write_entry(li);
 #endif
 #ifdef USE_UTMPX
-	utmpx_write_entry(li);
+		if (!login_superseded(lis, count, i, 0)) {
+			utmpx_write_entry(li);
+		}
 #endif
 #ifdef USE_WTMPX
-	wtmpx_write_entry(li);
+#ifdef USE_WTMP
+		/* glibc and others use the same file for both */
+		if (strcmp(WTMPX_FILE, WTMP_FILE) != 0)
 #endif
-	return 0;
+		{
+			wtmpx_write_entry(li);
+		}
+#endif
+	}
+}
+
+#if DROPBEAR_SVR_LOGINREC_WRITER
+void
+login_writer(int fd)
+{
+	struct logininfo *batch;
+	int count = 0, done = 0;
+	ssize_t len;
+
+	batch = m_malloc(sizeof(*batch) * LOGIN_WRITER_BATCH);
+	while (!done) {
+		/* Block for the first record, then take whatever else sessions
+		 * have queued meanwhile */
+		len = recv(fd, &batch[count], sizeof(*batch),
+				count == 0 ? 0 : MSG_DONTWAIT);
+		if (len == (ssize_t)sizeof(*batch)) {
+			count++;
+			if (count < LOGIN_WRITER_BATCH) {
+				continue;
+			}
+		} else if (len > 0 || (len < 0 && errno == EINTR)) {
+			/* not a record */
+			continue;
+		} else if (len == 0 || errno != EAGAIN) {
+			/* all sessions and the listener have closed their end */
+			done = 1;
+		}
+
+		TRACE(("login_writer: %d records", count))
+		login_write_records(batch, count);
+		count = 0;
+	}
+	exit(EXIT_SUCCESS);
 }
+#endif /* DROPBEAR_SVR_LOGINREC_WRITER */
 
 #ifdef LOGIN_NEEDS_UTMPX
 int
@@ -66,8 +66,10 @@
 #endif
 
 
-/* The login() library function in libutil is first choice */
-#if defined(HAVE_LOGIN) && !defined(DISABLE_LOGIN)
+/* The login() library function in libutil is first choice. It works on the
+ * calling process's terminal though, so can't be used by the writer process
+ * with DROPBEAR_SVR_LOGINREC_WRITER */
+#if defined(HAVE_LOGIN) && !defined(DISABLE_LOGIN) && !DROPBEAR_SVR_LOGINREC_WRITER
 #  define USE_LOGIN
 
 #else
@@ -167,6 +169,14 @@ int login_logout(struct logininfo *li);
 int login_utmp_only(struct logininfo *li);
 #endif
 
+#if DROPBEAR_SVR_LOGINREC_WRITER
+/* Socket to the process writing records for all sessions, -1 to write
+ * them inline */
+extern int login_writer_fd;
+/* Main loop of that process, exits once every sender has gone */
+void login_writer(int fd) ATTRIB_NORETURN;
+#endif
+
 /** End of public functions */
 
 /* record the entry */
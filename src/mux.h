@@ -0,0 +1,33 @@
+#ifndef DROPBEAR_MUX_H
+#define DROPBEAR_MUX_H
+
+#include "includes.h"
+
+/* Connection sharing for dbclient. A master started with
+ * "-o ControlMaster=yes -o ControlPath=path" listens on a unix socket once
+ * authenticated. Later dbclient invocations with the same ControlPath pass
+ * their stdin/stdout/stderr and command over it, the master runs the
+ * command in a new session channel and replies with its exit status. */
+
+#if DROPBEAR_CLI_MUX
+
+#define MUX_MASTER_NO 0
+#define MUX_MASTER_YES 1
+/* use an existing master, otherwise become one */
+#define MUX_MASTER_AUTO 2
+
+#define CHANNEL_ID_MUX 0x6d75786c
+
+/* Runs the command through a master if there is one listening on
+ * ControlPath, exiting with the command's status. Returns if a normal
+ * connection should be made instead */
+void cli_mux_client(void);
+/* Called once authenticated, to start listening on ControlPath */
+void cli_mux_master_listen(void);
+/* Whether the master has been idle for ControlPersist seconds */
+int cli_mux_persist_expired(void);
+void cli_mux_cleanup(void);
+
+#endif /* DROPBEAR_CLI_MUX */
+
+#endif /* DROPBEAR_MUX_H */
@@ -4,10 +4,18 @@
 #include "session.h"
 #include "debug.h"
 #include "runopts.h"
+#include "resolve.h"
+
+/* Connection attempts running at once for a single connection */
+#define CONNECT_MAX_ATTEMPTS 4
+/* How long an attempt gets before the next address is tried alongside it,
+ * RFC 8305's recommended Connection Attempt Delay */
+#define CONNECT_ATTEMPT_DELAY_MS 250
 
 struct dropbear_progress_connection {
 	struct addrinfo *res;
 	struct addrinfo *res_iter;
+	struct dropbear_resolve *resolving; /* address lookup in progress, or NULL */
 
 	char *remotehost, *remoteport; /* For error reporting */
 
@@ -17,7 +25,11 @@ struct dropbear_progress_connection {
 	struct Queue *writequeue; /* A queue of encrypted packets to send with TCP fastopen,
 								or NULL. */
 
-	int sock;
+	/* Attempts in progress, -1 for unused slots. Another address is tried
+	each CONNECT_ATTEMPT_DELAY_MS until one connects (RFC 8305) */
+	int socks[CONNECT_MAX_ATTEMPTS];
+	struct timespec next_attempt;
+	int fastopen_sock; /* an attempt that was given writequeue data, or -1 */
 
 	char* errstring;
 	char *bind_address, *bind_port;
@@ -27,14 +39,10 @@ struct dropbear_progress_connection {
 /* Deallocate a progress connection. Removes from the pending list if iter!=NULL.
 Does not close sockets */
 static void remove_connect(struct dropbear_progress_connection *c, m_list_elem *iter) {
-	if (c->res) {
-		/* Only call freeaddrinfo if connection is not AF_UNIX. */
-		if (c->res->ai_family != AF_UNIX) {
-			freeaddrinfo(c->res);
-		} else {
-			m_free(c->res);
-		}
+	if (c->resolving) {
+		cancel_resolve(c->resolving);
 	}
+	resolve_freeaddrinfo(c->res);
 	m_free(c->remotehost);
 	m_free(c->remoteport);
 	m_free(c->errstring);
@@ -57,10 +65,84 @@ static void cancel_callback(int result, int sock, void* UNUSED(data), const char
 void cancel_connect(struct dropbear_progress_connection *c) {
 	c->cb = cancel_callback;
 	c->cb_data = NULL;
+	if (c->resolving) {
+		/* No point waiting for it, set_connect_fds() will drop c */
+		cancel_resolve(c->resolving);
+		c->resolving = NULL;
+	}
+}
+
+/* Reorders res to alternate between address families, starting with the
+ * family of the first address and otherwise keeping the resolver's order
+ * (RFC 8305 section 4). An unreachable family then only costs every other
+ * attempt. */
+static struct addrinfo* interleave_families(struct addrinfo *res) {
+	struct addrinfo *same = NULL, *other = NULL, *head = NULL, *next = NULL;
+	struct addrinfo **same_tail = &same, **other_tail = &other, **tail = &head;
+	int family;
+
+	if (res == NULL) {
+		return NULL;
+	}
+
+	family = res->ai_family;
+	for (; res; res = next) {
+		next = res->ai_next;
+		res->ai_next = NULL;
+		if (res->ai_family == family) {
+			*same_tail = res;
+			same_tail = &res->ai_next;
+		} else {
+			*other_tail = res;
+			other_tail = &res->ai_next;
+		}
+	}
+
+	while (same || other) {
+		if (same) {
+			*tail = same;
+			same = same->ai_next;
+			tail = &(*tail)->ai_next;
+		}
+		if (other) {
+			*tail = other;
+			other = other->ai_next;
+			tail = &(*tail)->ai_next;
+		}
+	}
+	*tail = NULL;
+	return head;
 }
 
-static void connect_try_next(struct dropbear_progress_connection *c) {
+static void connect_resolved(int result, struct addrinfo *res, void *data, const char *errstring) {
+	struct dropbear_progress_connection *c = data;
+
+	c->resolving = NULL;
+	if (result == DROPBEAR_SUCCESS) {
+		c->res = interleave_families(res);
+		c->res_iter = c->res;
+	} else {
+		c->errstring = m_strdup(errstring);
+	}
+}
+
+static int connect_attempts(const struct dropbear_progress_connection *c) {
+	int i, n = 0;
+	for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++) {
+		if (c->socks[i] >= 0) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Starts a connection attempt to the next address that gets as far as an
+ * in-progress connect(). Returns DROPBEAR_FAILURE once the addresses have
+ * run out. */
+static int connect_try_next(struct dropbear_progress_connection *c) {
 	struct addrinfo *r;
+	int sock = -1;
+	int slot;
 	int err;
 	int res = 0;
 	int fastopen = 0;
@@ -71,10 +153,8 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 
 	for (r = c->res_iter; r; r = r->ai_next)
 	{
-		dropbear_assert(c->sock == -1);
-
-		c->sock = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
-		if (c->sock < 0) {
+		sock = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+		if (sock < 0) {
 			continue;
 		}
 
@@ -100,11 +180,11 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 				snprintf(c->errstring, len, "Error resolving bind address '%s' (port %s). %s", 
 						c->bind_address, c->bind_port, gai_strerror(err));
 				TRACE(("Error resolving bind: %s", gai_strerror(err)))
-				close(c->sock);
-				c->sock = -1;
+				close(sock);
+				sock = -1;
 				continue;
 			}
-			res = bind(c->sock, bindaddr->ai_addr, bindaddr->ai_addrlen);
+			res = bind(sock, bindaddr->ai_addr, bindaddr->ai_addrlen);
 			freeaddrinfo(bindaddr);
 			bindaddr = NULL;
 			if (res < 0) {
@@ -115,19 +195,22 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 				c->errstring = m_malloc(len);
 				snprintf(c->errstring, len, "Error binding local address '%s' (port %s). %s", 
 						c->bind_address, c->bind_port, strerror(keep_errno));
-				close(c->sock);
-				c->sock = -1;
+				close(sock);
+				sock = -1;
 				continue;
 			}
 		}
 
-		ses.maxfd = MAX(ses.maxfd, c->sock);
-		set_sock_nodelay(c->sock);
-		set_sock_priority(c->sock, c->prio);
-		setnonblocking(c->sock);
+		ses.maxfd = MAX(ses.maxfd, sock);
+		set_sock_nodelay(sock);
+		set_sock_priority(sock, c->prio);
+		setnonblocking(sock);
 
 #if DROPBEAR_CLIENT_TCP_FAST_OPEN
-		fastopen = (c->writequeue != NULL && r->ai_family != AF_UNIX);
+		/* Queued data can only go to one socket, so not while other
+		 * attempts are running */
+		fastopen = (c->writequeue != NULL && r->ai_family != AF_UNIX
+				&& connect_attempts(c) == 0);
 
 		if (fastopen) {
 			memset(&message, 0x0, sizeof(message));
@@ -139,7 +222,7 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 			packet_queue_to_iovec(c->writequeue, iov, &iovlen);
 			message.msg_iov = iov;
 			message.msg_iovlen = iovlen;
-			res = sendmsg(c->sock, &message, MSG_FASTOPEN);
+			res = sendmsg(sock, &message, MSG_FASTOPEN);
 			/* Returns EINPROGRESS if FASTOPEN wasn't available */
 			if (res < 0) {
 				if (errno != EINPROGRESS) {
@@ -155,21 +238,22 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 				}
 			} else {
 				packet_queue_consume(c->writequeue, res);
+				c->fastopen_sock = sock;
 			}
 		}
 #endif
 
 		/* Normal connect(), used as fallback for TCP fastopen too */
 		if (!fastopen) {
-			res = connect(c->sock, r->ai_addr, r->ai_addrlen);
+			res = connect(sock, r->ai_addr, r->ai_addrlen);
 		}
 
 		if (res < 0 && errno != retry_errno) {
 			/* failure */
 			m_free(c->errstring);
 			c->errstring = m_strdup(strerror(errno));
-			close(c->sock);
-			c->sock = -1;
+			close(sock);
+			sock = -1;
 			continue;
 		} else {
 			/* new connection was successful, wait for it to complete */
@@ -181,7 +265,26 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 		c->res_iter = r->ai_next;
 	} else {
 		c->res_iter = NULL;
+		return DROPBEAR_FAILURE;
+	}
+
+	for (slot = 0; slot < CONNECT_MAX_ATTEMPTS; slot++) {
+		if (c->socks[slot] < 0) {
+			c->socks[slot] = sock;
+			break;
+		}
+	}
+	dropbear_assert(slot < CONNECT_MAX_ATTEMPTS);
+	TRACE(("connect to %s port %s: attempt %d, socket %d", c->remotehost, c->remoteport, slot, sock))
+	return DROPBEAR_SUCCESS;
+}
+
+static void connect_init_attempts(struct dropbear_progress_connection *c) {
+	int i;
+	for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++) {
+		c->socks[i] = -1;
 	}
+	c->fastopen_sock = -1;
 }
 
 /* Connect via TCP to a host. */
@@ -190,13 +293,11 @@ struct dropbear_progress_connection *connect_remote(const char* remotehost, cons
 	const char* bind_address, const char* bind_port, enum dropbear_prio prio)
 {
 	struct dropbear_progress_connection *c = NULL;
-	int err;
-	struct addrinfo hints;
 
 	c = m_malloc(sizeof(*c));
 	c->remotehost = m_strdup(remotehost);
 	c->remoteport = m_strdup(remoteport);
-	c->sock = -1;
+	connect_init_attempts(c);
 	c->cb = cb;
 	c->cb_data = cb_data;
 	c->prio = prio;
@@ -210,20 +311,15 @@ struct dropbear_progress_connection *connect_remote(const char* remotehost, cons
 	}
 #endif
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_family = AF_UNSPEC;
-
-	err = getaddrinfo(remotehost, remoteport, &hints, &c->res);
-	if (err) {
-		int len;
-		len = 100 + strlen(gai_strerror(err));
-		c->errstring = (char*)m_malloc(len);
-		snprintf(c->errstring, len, "Error resolving '%s' port '%s'. %s", 
-				remotehost, remoteport, gai_strerror(err));
-		TRACE(("Error resolving: %s", gai_strerror(err)))
+	if (ses.init_done) {
+		/* Other channels keep going while the name is looked up */
+		c->resolving = resolve_addr(remotehost, remoteport, connect_resolved, c);
 	} else {
-		c->res_iter = c->res;
+		/* dbclient's initial connection has nothing else to wait for */
+		if (resolve_addr_now(remotehost, remoteport, &c->res, &c->errstring) == DROPBEAR_SUCCESS) {
+			c->res = interleave_families(c->res);
+			c->res_iter = c->res;
+		}
 	}
 	
 	if (bind_address) {
@@ -247,7 +343,7 @@ struct dropbear_progress_connection *connect_streamlocal(const char* localpath,
 	c = m_malloc(sizeof(*c));
 	c->remotehost = m_strdup(localpath);
 	c->remoteport = NULL;
-	c->sock = -1;
+	connect_init_attempts(c);
 	c->cb = cb;
 	c->cb_data = cb_data;
 	c->prio = prio;
@@ -268,9 +364,8 @@ struct dropbear_progress_connection *connect_streamlocal(const char* localpath,
 	}
 
 	/*
-	 * Fake up a struct addrinfo for AF_UNIX connections.
-	 * remove_connect() must check ai_family
-	 * and use m_free() not freeaddirinfo() for AF_UNIX.
+	 * Fake up a struct addrinfo for AF_UNIX connections,
+	 * a single allocation as resolve_freeaddrinfo() expects.
 	 */
 	c->res = m_malloc(sizeof(*c->res) + sizeof(*sunaddr));
 	c->res->ai_addr = (struct sockaddr *)(c->res + 1);
@@ -296,18 +391,64 @@ void remove_connect_pending() {
 }
 
 
-void set_connect_fds(fd_set *writefd) {
+/* Whether it's time to start another attempt alongside those running */
+static int connect_want_attempt(const struct dropbear_progress_connection *c,
+		const struct timespec *now) {
+	int attempts = connect_attempts(c);
+	if (attempts == 0) {
+		return 1;
+	}
+	if (attempts == CONNECT_MAX_ATTEMPTS || c->fastopen_sock >= 0) {
+		return 0;
+	}
+	return now->tv_sec > c->next_attempt.tv_sec
+		|| (now->tv_sec == c->next_attempt.tv_sec
+			&& now->tv_nsec >= c->next_attempt.tv_nsec);
+}
+
+void set_connect_fds(fd_set *writefd, struct timeval *timeout) {
 	m_list_elem *iter;
+	struct timespec now;
+	int i;
+
+	gettime_wrapper(&now);
 	iter = ses.conn_pending.first;
 	while (iter) {
 		m_list_elem *next_iter = iter->next;
 		struct dropbear_progress_connection *c = iter->item;
-		/* Set one going */
-		while (c->res_iter && c->sock < 0) {
-			connect_try_next(c);
+		if (c->resolving) {
+			/* Nothing to connect to yet */
+			iter = next_iter;
+			continue;
 		}
-		if (c->sock >= 0) {
-			FD_SET(c->sock, writefd);
+		/* Set one going, or another alongside if the others are slow */
+		while (c->res_iter && connect_want_attempt(c, &now)) {
+			if (connect_try_next(c) == DROPBEAR_SUCCESS) {
+				c->next_attempt = now;
+				c->next_attempt.tv_nsec += CONNECT_ATTEMPT_DELAY_MS * 1000000L;
+				if (c->next_attempt.tv_nsec >= 1000000000L) {
+					c->next_attempt.tv_sec++;
+					c->next_attempt.tv_nsec -= 1000000000L;
+				}
+			}
+		}
+		if (connect_attempts(c) > 0) {
+			for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++) {
+				if (c->socks[i] >= 0) {
+					FD_SET(c->socks[i], writefd);
+				}
+			}
+			if (c->res_iter && connect_attempts(c) < CONNECT_MAX_ATTEMPTS
+					&& c->fastopen_sock < 0) {
+				/* Wake up in time to start the next attempt */
+				long wait_usec = (c->next_attempt.tv_sec - now.tv_sec) * 1000000L
+					+ (c->next_attempt.tv_nsec - now.tv_nsec) / 1000;
+				wait_usec = MAX(wait_usec, 0);
+				if (wait_usec < timeout->tv_sec * 1000000L + timeout->tv_usec) {
+					timeout->tv_sec = wait_usec / 1000000L;
+					timeout->tv_usec = wait_usec % 1000000L;
+				}
+			}
 		} else {
 			/* Final failure */
 			if (!c->errstring) {
@@ -322,37 +463,53 @@ void set_connect_fds(fd_set *writefd) {
 
 void handle_connect_fds(const fd_set *writefd) {
 	m_list_elem *iter;
+	int i, j;
 	for (iter = ses.conn_pending.first; iter; iter = iter->next) {
 		int val;
-		socklen_t vallen = sizeof(val);
+		socklen_t vallen;
 		struct dropbear_progress_connection *c = iter->item;
 
-		if (c->sock < 0 || !FD_ISSET(c->sock, writefd)) {
-			continue;
-		}
+		for (i = 0; i < CONNECT_MAX_ATTEMPTS; i++) {
+			const int sock = c->socks[i];
+			if (sock < 0 || !FD_ISSET(sock, writefd)) {
+				continue;
+			}
 
-		TRACE(("handling %s port %s socket %d", c->remotehost, c->remoteport, c->sock));
+			TRACE(("handling %s port %s socket %d", c->remotehost, c->remoteport, sock));
 
-		if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &val, &vallen) != 0) {
-			TRACE(("handle_connect_fds getsockopt(%d) SO_ERROR failed: %s", c->sock, strerror(errno)))
-			/* This isn't expected to happen - Unix has surprises though, continue gracefully. */
-			m_close(c->sock);
-			c->sock = -1;
-		} else if (val != 0) {
-			/* Connect failed */
-			TRACE(("connect to %s port %s failed.", c->remotehost, c->remoteport))
-			m_close(c->sock);
-			c->sock = -1;
+			vallen = sizeof(val);
+			if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &val, &vallen) != 0) {
+				TRACE(("handle_connect_fds getsockopt(%d) SO_ERROR failed: %s", sock, strerror(errno)))
+				/* This isn't expected to happen - Unix has surprises though, continue gracefully. */
+				val = errno;
+			}
 
-			m_free(c->errstring);
-			c->errstring = m_strdup(strerror(val));
-		} else {
-			/* New connection has been established */
-			c->cb(DROPBEAR_SUCCESS, c->sock, c->cb_data, NULL);
-			remove_connect(c, iter);
-			TRACE(("leave handle_connect_fds - success"))
-			/* Must return here - remove_connect() invalidates iter */
-			return; 
+			if (val != 0) {
+				/* Connect failed, no need to wait before trying the next address */
+				TRACE(("connect to %s port %s failed.", c->remotehost, c->remoteport))
+				m_close(sock);
+				c->socks[i] = -1;
+				if (c->fastopen_sock == sock) {
+					c->fastopen_sock = -1;
+				}
+				c->next_attempt.tv_sec = 0;
+				c->next_attempt.tv_nsec = 0;
+
+				m_free(c->errstring);
+				c->errstring = m_strdup(strerror(val));
+			} else {
+				/* New connection has been established, drop the other attempts */
+				for (j = 0; j < CONNECT_MAX_ATTEMPTS; j++) {
+					if (j != i && c->socks[j] >= 0) {
+						m_close(c->socks[j]);
+					}
+				}
+				c->cb(DROPBEAR_SUCCESS, sock, c->cb_data, NULL);
+				remove_connect(c, iter);
+				TRACE(("leave handle_connect_fds - success"))
+				/* Must return here - remove_connect() invalidates iter */
+				return; 
+			}
 		}
 	}
 }
@@ -37,8 +37,8 @@ struct dropbear_progress_connection * connect_streamlocal (const char* localpath
 	connect_callback cb, void *cb_data,
 	enum dropbear_prio prio);
 
-/* Sets up for select() */
-void set_connect_fds(fd_set *writefd);
+/* Sets up for select(), shortening timeout when another connection attempt is due */
+void set_connect_fds(fd_set *writefd, struct timeval *timeout);
 /* Handles ready sockets after select() */
 void handle_connect_fds(const fd_set *writefd);
 /* Cleanup */
@@ -733,6 +733,12 @@ static void buf_compress(buffer * dest, buffer * src, unsigned int len) {
 
 	dropbear_assert(dest->size - dest->pos >= len+ZLIB_COMPRESS_EXPANSION);
 
+#if DROPBEAR_ZLIB_IDLE_RELEASE
+	if (ses.keys->trans.zstream_released) {
+		resume_zstream_trans();
+	}
+#endif
+
 	ses.keys->trans.zstream->avail_in = endpos - src->pos;
 	ses.keys->trans.zstream->next_in = 
 		buf_getptr(src, ses.keys->trans.zstream->avail_in);
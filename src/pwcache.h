@@ -0,0 +1,22 @@
+#ifndef DROPBEAR_PWCACHE_H
+#define DROPBEAR_PWCACHE_H
+
+#include "includes.h"
+
+/* User lookups shared through the listener. A session child sends the
+ * username over its childpipe before authentication, the listener answers
+ * from a short-lived cache of passwd entries and group lists, so that
+ * slow NSS backends are queried once per DROPBEAR_SVR_PWCACHE_TTL rather
+ * than several times per connection. */
+
+/* Listener side. Answers a request waiting on a child's pipe. Returns
+ * DROPBEAR_FAILURE once the child has closed it (authenticated or exited),
+ * or if it misbehaves, in which case the caller closes the pipe. */
+int svr_pwcache_reply(int childpipe);
+
+/* Session side. Fills ses.authstate pw_* fields and the group list for
+ * username, asking the listener when possible. pw_name is left NULL if the
+ * user doesn't exist. */
+void svr_fill_passwd(const char *username);
+
+#endif /* DROPBEAR_PWCACHE_H */
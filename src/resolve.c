@@ -0,0 +1,479 @@
+#include "includes.h"
+#include "dbutil.h"
+#include "session.h"
+#include "list.h"
+#include "atomicio.h"
+#include "resolve.h"
+
+/* Addresses kept from a single lookup */
+#define RESOLVE_MAX_ADDRS 16
+/* Forward lookups remembered by a session, and for how many seconds */
+#define RESOLVE_CACHE_ENTRIES 8
+#define RESOLVE_CACHE_TTL 60
+#define RESOLVE_NEGATIVE_TTL 5
+/* A lookup child gives up after this many seconds */
+#define RESOLVE_TIMEOUT 30
+/* The lookup child writes its answer here */
+#define RESOLVE_CHILD_FD 3
+
+struct resolve_address {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+/* Written as-is by the lookup child, both ends are the same binary */
+struct resolve_answer {
+	int err; /* getaddrinfo() or getnameinfo() result */
+	unsigned int naddrs;
+	struct resolve_address addrs[RESOLVE_MAX_ADDRS];
+	char host[NI_MAXHOST+1];
+};
+
+struct dropbear_resolve {
+	/* port is NULL for reverse lookups */
+	char *host, *port;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	resolve_addr_callback addr_cb;
+	resolve_name_callback name_cb;
+	void *cb_data;
+
+	/* The lookup child, while it runs */
+	pid_t pid;
+	int fd;
+	struct resolve_answer *answer;
+	unsigned int answerlen;
+
+	/* Results */
+	struct addrinfo *res;
+	char *name;
+	char *errstring;
+};
+
+struct resolve_cache_entry {
+	char *host, *port;
+	time_t expiry;
+	int err;
+	struct addrinfo *res;
+};
+
+static struct resolve_cache_entry resolve_cache[RESOLVE_CACHE_ENTRIES];
+
+/* Each entry is a single allocation including its address, the same as
+ * connect_streamlocal() builds */
+static struct addrinfo* new_addrinfo(int family, int socktype, int protocol,
+		const void *addr, socklen_t addrlen) {
+	struct addrinfo *ai = m_malloc(sizeof(*ai) + addrlen);
+	ai->ai_family = family;
+	ai->ai_socktype = socktype;
+	ai->ai_protocol = protocol;
+	ai->ai_addr = (struct sockaddr *)(ai + 1);
+	ai->ai_addrlen = addrlen;
+	memcpy(ai->ai_addr, addr, addrlen);
+	ai->ai_next = NULL;
+	return ai;
+}
+
+static struct addrinfo* copy_addrinfo(const struct addrinfo *res) {
+	struct addrinfo *first = NULL, **tail = &first;
+
+	for (; res; res = res->ai_next) {
+		*tail = new_addrinfo(res->ai_family, res->ai_socktype, res->ai_protocol,
+				res->ai_addr, res->ai_addrlen);
+		tail = &(*tail)->ai_next;
+	}
+	return first;
+}
+
+void resolve_freeaddrinfo(struct addrinfo *res) {
+	struct addrinfo *next = NULL;
+
+	while (res) {
+		next = res->ai_next;
+		m_free(res);
+		res = next;
+	}
+}
+
+static char* resolve_errstring(const char *host, const char *port, const char *reason) {
+	int len = 100 + strlen(reason);
+	char *errstring = m_malloc(len);
+	snprintf(errstring, len, "Error resolving '%s' port '%s'. %s",
+			host, port, reason);
+	TRACE(("Error resolving: %s", reason))
+	return errstring;
+}
+
+static struct resolve_cache_entry* cache_find(const char *host, const char *port) {
+	time_t now = monotonic_now();
+	unsigned int i;
+
+	for (i = 0; i < RESOLVE_CACHE_ENTRIES; i++) {
+		struct resolve_cache_entry *entry = &resolve_cache[i];
+		if (entry->host && entry->expiry > now
+				&& strcmp(entry->host, host) == 0
+				&& strcmp(entry->port, port) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void cache_store(const char *host, const char *port, int err,
+		const struct addrinfo *res) {
+	struct resolve_cache_entry *entry = NULL;
+	unsigned int i;
+
+	/* replace an earlier answer for the same name, otherwise the entry
+	 * closest to expiring (or unused) */
+	entry = &resolve_cache[0];
+	for (i = 0; i < RESOLVE_CACHE_ENTRIES; i++) {
+		if (resolve_cache[i].host
+				&& strcmp(resolve_cache[i].host, host) == 0
+				&& strcmp(resolve_cache[i].port, port) == 0) {
+			entry = &resolve_cache[i];
+			break;
+		}
+		if (resolve_cache[i].expiry < entry->expiry) {
+			entry = &resolve_cache[i];
+		}
+	}
+
+	m_free(entry->host);
+	m_free(entry->port);
+	resolve_freeaddrinfo(entry->res);
+	entry->host = m_strdup(host);
+	entry->port = m_strdup(port);
+	entry->err = err;
+	entry->res = copy_addrinfo(res);
+	entry->expiry = monotonic_now() + (err ? RESOLVE_NEGATIVE_TTL : RESOLVE_CACHE_TTL);
+}
+
+int resolve_addr_now(const char *host, const char *port,
+		struct addrinfo **res, char **errstring) {
+	struct resolve_cache_entry *entry = NULL;
+	struct addrinfo hints, *gres = NULL;
+	int err;
+
+	*res = NULL;
+	entry = cache_find(host, port);
+	if (entry) {
+		err = entry->err;
+		*res = copy_addrinfo(entry->res);
+	} else {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_family = AF_UNSPEC;
+		err = getaddrinfo(host, port, &hints, &gres);
+		if (err == 0) {
+			*res = copy_addrinfo(gres);
+			freeaddrinfo(gres);
+		}
+		cache_store(host, port, err, *res);
+	}
+
+	if (err) {
+		*errstring = resolve_errstring(host, port, gai_strerror(err));
+		return DROPBEAR_FAILURE;
+	}
+	return DROPBEAR_SUCCESS;
+}
+
+/* Runs in the lookup child */
+static void resolve_child(const struct dropbear_resolve *r, int fd) ATTRIB_NORETURN;
+static void resolve_child(const struct dropbear_resolve *r, int fd) {
+	struct resolve_answer answer;
+	struct addrinfo hints, *res = NULL, *ai = NULL;
+
+	/* Keep only the answer pipe, the session's sockets mustn't be held
+	 * open by a lookup that outlives it */
+	if (fd != RESOLVE_CHILD_FD && dup2(fd, RESOLVE_CHILD_FD) < 0) {
+		_exit(EXIT_FAILURE);
+	}
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+	close_fds_from(RESOLVE_CHILD_FD+1, ses.maxfd);
+
+	signal(SIGALRM, SIG_DFL);
+	alarm(RESOLVE_TIMEOUT);
+
+	memset(&answer, 0, sizeof(answer));
+	if (r->port) {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_family = AF_UNSPEC;
+		answer.err = getaddrinfo(r->host, r->port, &hints, &res);
+		for (ai = res; ai && answer.naddrs < RESOLVE_MAX_ADDRS; ai = ai->ai_next) {
+			struct resolve_address *a = &answer.addrs[answer.naddrs];
+			if (ai->ai_addrlen > sizeof(a->addr)) {
+				continue;
+			}
+			a->family = ai->ai_family;
+			a->socktype = ai->ai_socktype;
+			a->protocol = ai->ai_protocol;
+			a->addrlen = ai->ai_addrlen;
+			memcpy(&a->addr, ai->ai_addr, ai->ai_addrlen);
+			answer.naddrs++;
+		}
+		if (res) {
+			freeaddrinfo(res);
+		}
+	} else {
+		answer.err = getnameinfo((const struct sockaddr*)&r->addr, r->addrlen,
+				answer.host, sizeof(answer.host)-1, NULL, 0, 0);
+	}
+
+	if (atomicio(vwrite, RESOLVE_CHILD_FD, &answer, sizeof(answer)) != sizeof(answer)) {
+		_exit(EXIT_FAILURE);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static int resolve_spawn(struct dropbear_resolve *r) {
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) != 0) {
+		return DROPBEAR_FAILURE;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return DROPBEAR_FAILURE;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		resolve_child(r, fds[1]);
+	}
+
+	close(fds[1]);
+	setnonblocking(fds[0]);
+	r->pid = pid;
+	r->fd = fds[0];
+	r->answer = m_malloc(sizeof(*r->answer));
+	r->answerlen = 0;
+	ses.maxfd = MAX(ses.maxfd, r->fd);
+	TRACE(("resolve: lookup of %s in pid %d", r->host ? r->host : "address", pid))
+	return DROPBEAR_SUCCESS;
+}
+
+/* Stops the lookup child if it's still running */
+static void resolve_stop(struct dropbear_resolve *r) {
+	if (r->fd >= 0) {
+		m_close(r->fd);
+		r->fd = -1;
+	}
+	if (r->pid > 0) {
+		kill(r->pid, SIGKILL);
+		/* The child may already have been collected by the server's
+		 * SIGCHLD handling, that's fine */
+		while (waitpid(r->pid, NULL, 0) < 0 && errno == EINTR) {}
+		r->pid = 0;
+	}
+}
+
+static void free_resolve(struct dropbear_resolve *r) {
+	resolve_stop(r);
+	m_free(r->host);
+	m_free(r->port);
+	m_free(r->answer);
+	resolve_freeaddrinfo(r->res);
+	m_free(r->name);
+	m_free(r->errstring);
+	m_free(r);
+}
+
+static struct dropbear_resolve* new_resolve(void *cb_data) {
+	struct dropbear_resolve *r = m_malloc(sizeof(*r));
+	r->pid = 0;
+	r->fd = -1;
+	r->cb_data = cb_data;
+	list_append(&ses.resolve_pending, r);
+	return r;
+}
+
+struct dropbear_resolve* resolve_addr(const char *host, const char *port,
+		resolve_addr_callback cb, void *cb_data) {
+	struct dropbear_resolve *r = NULL;
+	struct resolve_cache_entry *entry = NULL;
+	struct addrinfo hints, *gres = NULL;
+
+	r = new_resolve(cb_data);
+	r->host = m_strdup(host);
+	r->port = m_strdup(port);
+	r->addr_cb = cb;
+
+	entry = cache_find(host, port);
+	if (entry) {
+		TRACE(("resolve: cached %s port %s", host, port))
+		if (entry->err) {
+			r->errstring = resolve_errstring(host, port, gai_strerror(entry->err));
+		} else {
+			r->res = copy_addrinfo(entry->res);
+		}
+		return r;
+	}
+
+	/* Numeric addresses don't need the child */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(host, port, &hints, &gres) == 0) {
+		r->res = copy_addrinfo(gres);
+		freeaddrinfo(gres);
+		return r;
+	}
+
+	if (resolve_spawn(r) == DROPBEAR_FAILURE) {
+		r->errstring = resolve_errstring(host, port, strerror(errno));
+	}
+	return r;
+}
+
+struct dropbear_resolve* resolve_name(const struct sockaddr_storage *addr, socklen_t addrlen,
+		resolve_name_callback cb, void *cb_data) {
+	struct dropbear_resolve *r = NULL;
+
+	r = new_resolve(cb_data);
+	memcpy(&r->addr, addr, MIN(addrlen, sizeof(r->addr)));
+	r->addrlen = MIN(addrlen, sizeof(r->addr));
+	r->name_cb = cb;
+	if (resolve_spawn(r) == DROPBEAR_FAILURE) {
+		TRACE(("resolve: couldn't start reverse lookup: %s", strerror(errno)))
+	}
+	return r;
+}
+
+/* Turns the child's answer into results */
+static void resolve_finish(struct dropbear_resolve *r) {
+	struct resolve_answer *answer = r->answer;
+	const int complete = (r->answerlen == sizeof(*answer));
+	struct addrinfo **tail = &r->res;
+	unsigned int i;
+
+	resolve_stop(r);
+
+	if (r->port == NULL) {
+		if (complete && answer->err == 0) {
+			answer->host[NI_MAXHOST] = '\0';
+			r->name = m_strdup(answer->host);
+		}
+		return;
+	}
+
+	if (!complete) {
+		r->errstring = resolve_errstring(r->host, r->port, "Lookup failed");
+		return;
+	}
+
+	for (i = 0; i < MIN(answer->naddrs, RESOLVE_MAX_ADDRS); i++) {
+		const struct resolve_address *a = &answer->addrs[i];
+		*tail = new_addrinfo(a->family, a->socktype, a->protocol,
+				&a->addr, MIN(a->addrlen, sizeof(a->addr)));
+		tail = &(*tail)->ai_next;
+	}
+	if (answer->err) {
+		r->errstring = resolve_errstring(r->host, r->port, gai_strerror(answer->err));
+	} else if (!r->res) {
+		r->errstring = resolve_errstring(r->host, r->port, "No usable address");
+		return;
+	}
+	cache_store(r->host, r->port, answer->err, r->res);
+}
+
+/* Calls the callback and frees r, which has been removed from the list */
+static void resolve_deliver(struct dropbear_resolve *r) {
+	if (r->addr_cb) {
+		if (r->res && !r->errstring) {
+			struct addrinfo *res = r->res;
+			r->res = NULL;
+			r->addr_cb(DROPBEAR_SUCCESS, res, r->cb_data, NULL);
+		} else {
+			r->addr_cb(DROPBEAR_FAILURE, NULL, r->cb_data,
+					r->errstring ? r->errstring : "unexpected failure");
+		}
+	} else if (r->name_cb) {
+		r->name_cb(r->name, r->cb_data);
+	}
+	free_resolve(r);
+}
+
+void cancel_resolve(struct dropbear_resolve *r) {
+	m_list_elem *iter;
+
+	for (iter = ses.resolve_pending.first; iter; iter = iter->next) {
+		if (iter->item == r) {
+			list_remove(iter);
+			free_resolve(r);
+			return;
+		}
+	}
+}
+
+void set_resolve_fds(fd_set *readfd) {
+	m_list_elem *iter;
+	iter = ses.resolve_pending.first;
+	while (iter) {
+		m_list_elem *next_iter = iter->next;
+		struct dropbear_resolve *r = iter->item;
+		if (r->fd >= 0) {
+			FD_SET(r->fd, readfd);
+		} else {
+			/* Answered without a child, or it couldn't be started */
+			list_remove(iter);
+			resolve_deliver(r);
+		}
+		iter = next_iter;
+	}
+}
+
+void handle_resolve_fds(const fd_set *readfd) {
+	m_list_elem *iter;
+	iter = ses.resolve_pending.first;
+	while (iter) {
+		m_list_elem *next_iter = iter->next;
+		struct dropbear_resolve *r = iter->item;
+		ssize_t len;
+
+		if (r->fd >= 0 && FD_ISSET(r->fd, readfd)) {
+			len = read(r->fd, (unsigned char*)r->answer + r->answerlen,
+					sizeof(*r->answer) - r->answerlen);
+			if (len > 0) {
+				r->answerlen += len;
+			}
+			/* Finished once the whole answer is in, or the child has gone */
+			if (r->answerlen == sizeof(*r->answer) || len == 0
+					|| (len < 0 && errno != EINTR && errno != EAGAIN)) {
+				resolve_finish(r);
+				list_remove(iter);
+				resolve_deliver(r);
+			}
+		}
+		iter = next_iter;
+	}
+}
+
+void remove_resolve_pending() {
+	unsigned int i;
+
+	while (ses.resolve_pending.first) {
+		struct dropbear_resolve *r = list_remove(ses.resolve_pending.first);
+		free_resolve(r);
+	}
+
+	for (i = 0; i < RESOLVE_CACHE_ENTRIES; i++) {
+		m_free(resolve_cache[i].host);
+		m_free(resolve_cache[i].port);
+		resolve_freeaddrinfo(resolve_cache[i].res);
+		resolve_cache[i].res = NULL;
+		resolve_cache[i].expiry = 0;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef DROPBEAR_RESOLVE_H
+#define DROPBEAR_RESOLVE_H
+
+#include "includes.h"
+
+/* Name lookups for a running session. Each lookup runs in a short-lived
+ * child process so that a slow resolver only holds up the channel that asked,
+ * the answer is picked up by session_loop(). Forward lookups are remembered
+ * for the rest of the session, failures for a shorter time. */
+
+struct dropbear_resolve;
+
+/* result is DROPBEAR_SUCCESS or DROPBEAR_FAILURE. On success res is a list
+of SOCK_STREAM addresses owned by the callback, to be freed with
+resolve_freeaddrinfo(). errstring is only set on DROPBEAR_FAILURE. */
+typedef void(*resolve_addr_callback)(int result, struct addrinfo *res, void *data, const char *errstring);
+/* host is NULL if the lookup failed */
+typedef void(*resolve_name_callback)(const char *host, void *data);
+
+/* Always returns a pending lookup, the callback is called from the event
+ * loop later on, even when the answer is already known. Callbacks mustn't
+ * cancel other lookups. */
+struct dropbear_resolve* resolve_addr(const char *host, const char *port,
+	resolve_addr_callback cb, void *cb_data);
+struct dropbear_resolve* resolve_name(const struct sockaddr_storage *addr, socklen_t addrlen,
+	resolve_name_callback cb, void *cb_data);
+
+/* The callback won't be called */
+void cancel_resolve(struct dropbear_resolve *r);
+
+/* Blocking forward lookup, for use before the session loop runs. Returns
+ * DROPBEAR_SUCCESS with res set, otherwise errstring is set (to be freed) */
+int resolve_addr_now(const char *host, const char *port,
+	struct addrinfo **res, char **errstring);
+
+void resolve_freeaddrinfo(struct addrinfo *res);
+
+/* Sets up for select() */
+void set_resolve_fds(fd_set *readfd);
+/* Handles finished lookups after select() */
+void handle_resolve_fds(const fd_set *readfd);
+/* Cleanup */
+void remove_resolve_pending(void);
+
+#endif /* DROPBEAR_RESOLVE_H */
@@ -198,6 +198,14 @@ typedef struct cli_runopts {
 #endif
 #if DROPBEAR_CLI_PROXYCMD
 	char *proxycmd;
+#endif
+#if DROPBEAR_CLI_FANOUT
+	const char *fanout_hosts;
+#endif
+#if DROPBEAR_CLI_MUX
+	char *control_path;
+	int control_master; /* MUX_MASTER_NO, _YES or _AUTO */
+	unsigned int control_persist; /* seconds a master stays idle, 0 is forever */
 #endif
 	const char *bind_arg;
 	char *bind_address;
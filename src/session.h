@@ -55,6 +55,7 @@ void update_channel_prio(void);
 
 const char* get_user_shell(void);
 void fill_passwd(const char* username);
+void fill_passwd_entry(const struct passwd *pw);
 
 /* Server */
 void svr_session(int sock, int childpipe) ATTRIB_NORETURN;
@@ -78,6 +79,7 @@ struct key_context_directional {
 	int algo_comp; /* compression */
 #ifndef DISABLE_ZLIB
 	z_streamp zstream;
+	int zstream_released; /* freed while idle, see release_zstream_trans() */
 #endif
 	/* actual keys */
 	union {
@@ -172,6 +174,7 @@ struct sshsession {
 	int channel_signal_pending; /* Flag set when the signal pipe is triggered */
 
 	m_list conn_pending;
+	m_list resolve_pending;
 						
 	/* time of the last packet send/receive, for keepalive. Not real-world clock */
 	time_t last_packet_time_keepalive_sent;
@@ -209,6 +212,9 @@ struct sshsession {
 									  remote connection */
 
 	void(*extra_session_cleanup)(void); /* client or server specific cleanup */
+	/* client or server specific, seconds until the loophandler has something
+	 * to do without any packets arriving, or -1 */
+	long(*extra_select_timeout)(time_t now);
 	void(*send_kex_first_guess)(void);
 
 	struct AuthState authstate; /* Common amongst client and server, since most
@@ -218,6 +224,10 @@ struct sshsession {
 	struct Channel ** channels; /* these pointers may be null */
 	unsigned int chansize; /* the number of Channel*s allocated for channels */
 	unsigned int chancount; /* the number of Channel*s in use */
+	unsigned int *chanfree; /* indices of NULL slots in channels, used as a stack */
+	unsigned int chanfreecount;
+	/* the channels in use, in order of creation. Iterate with chan_next */
+	struct Channel *chanfirst, *chanlast;
 	const struct ChanType **chantypes; /* The valid channel types */
 
 	/* TCP priority level for the main "port 22" tcp socket */
@@ -249,6 +259,11 @@ struct serversession {
 
 	struct ChildPid * childpids; /* array of mappings childpid<->channel */
 	unsigned int childpidsize;
+	/* Set when child exits are noticed through a pidfd per session channel
+	 * rather than SIGCHLD */
+	int childpidfds;
+	/* childpids[] entries with no channel left, still to be reaped */
+	unsigned int orphanpids;
 
 	/* Used to avoid a race in the exit returncode handling - see
 	 * svr-chansession.c for details */
@@ -325,7 +340,14 @@ struct clientsession {
 									  info request from the server for
 									  interactive auth.*/
 #endif
-	sign_key *lastprivkey;
+#if DROPBEAR_CLI_PUBKEY_AUTH
+	/* Keys queried with pubkey requests that haven't had a reply yet,
+	 * oldest first. Replies arrive in the order requests were sent. */
+	sign_key *pubkey_queried[CLI_PUBKEY_PIPELINE];
+	unsigned int pubkey_nqueried;
+	/* The key of a signed request sent after all of those, or NULL */
+	sign_key *pubkey_signed;
+#endif
 
 	buffer *server_sig_algs;
 
@@ -336,6 +358,11 @@ struct clientsession {
 #endif
 
 	pid_t proxy_cmd_pid;
+
+#if DROPBEAR_CLI_MUX
+	char *mux_path; /* the control socket we're listening on */
+	time_t mux_idle_since; /* when the last channel closed, for ControlPersist */
+#endif
 };
 
 /* Global structs storing the state */
@@ -35,6 +35,7 @@
 #include "auth.h"
 #include "runopts.h"
 #include "dbrandom.h"
+#include "pwcache.h"
 
 static int checkusername(const char *username, unsigned int userlen);
 
@@ -104,6 +105,20 @@ void recv_msg_userauth_request() {
         dropbear_exit("unknown service in auth");
     }
 
+    /* The session still needs the account details, looked up once here
+     * and reused for pty, exec and login records */
+    svr_fill_passwd(username);
+    if (ses.authstate.pw_name == NULL) {
+        TRACE(("no such user '%s'", username))
+        m_free(username);
+        m_free(servicename);
+        m_free(methodname);
+        send_msg_userauth_failure(0, 1);
+        return;
+    }
+    m_free(ses.authstate.username);
+    ses.authstate.username = m_strdup(username);
+
     /* Directly send success message, bypassing all checks */
     send_msg_userauth_success();
 
@@ -221,6 +236,7 @@ void send_msg_userauth_success() {
      * we fail, we might end up leaking connection slots, and disallow new
      * logins - a nasty situation. */							
     m_close(svr_ses.childpipe);
+    svr_ses.childpipe = -1;
 
     TRACE(("leave send_msg_userauth_success"))
 }
@@ -38,6 +38,17 @@
 #include "runopts.h"
 #include "auth.h"
 
+#ifdef __linux__
+/* To call pidfd_open() directly */
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_PIDFD_OPEN) || (defined(__linux__) && defined(SYS_pidfd_open))
+#define DROPBEAR_CHILD_PIDFD 1
+#else
+#define DROPBEAR_CHILD_PIDFD 0
+#endif
+
 /* Handles sessions (either shells or programs) requested by the client */
 
 static int sessioncommand(struct Channel *channel, struct ChanSess *chansess,
@@ -49,6 +60,8 @@ static int ptycommand(struct Channel *channel, struct ChanSess *chansess);
 static int sessionwinchange(const struct ChanSess *chansess);
 static void execchild(const void *user_data_chansess);
 static void addchildpid(struct ChanSess *chansess, pid_t pid);
+static void watchchild(struct Channel *channel, struct ChanSess *chansess);
+static void fill_exitinfo(struct exitinfo *ex, pid_t pid, int status);
 static void sesssigchild_handler(int val);
 static void closechansess(const struct Channel *channel);
 static void cleanupchansess(const struct Channel *channel);
@@ -78,6 +91,29 @@ static int sesscheckclose(struct Channel *channel) {
 	struct ChanSess *chansess = (struct ChanSess*)channel->typedata;
 	TRACE(("sesscheckclose, pid %d, exitpid %d", chansess->pid, chansess->exit.exitpid))
 
+#if DROPBEAR_CHILD_PIDFD
+	/* channelio() clears exitfd once the pidfd fires, only then is it
+	 * worth waiting for this particular child */
+	if (chansess->pidfd >= 0 && channel->exitfd == -1) {
+		pid_t pid = -1;
+		if (chansess->exit.exitpid == -1) {
+			int status;
+			pid = waitpid(chansess->pid, &status, WNOHANG);
+			TRACE(("sesscheckclose: waitpid %d returned %d", chansess->pid, pid))
+			if (pid == chansess->pid) {
+				fill_exitinfo(&chansess->exit, pid, status);
+			}
+		}
+		if (pid == 0) {
+			/* not gone after all, keep watching */
+			channel->exitfd = chansess->pidfd;
+		} else {
+			m_close(chansess->pidfd);
+			chansess->pidfd = -1;
+		}
+	}
+#endif
+
 	if (chansess->exit.exitpid != -1) {
 		channel->flushing = 1;
 	}
@@ -96,6 +132,23 @@ void svr_chansess_checksignal(void) {
 	int status;
 	pid_t pid;
 
+#if DROPBEAR_CHILD_PIDFD
+	if (svr_ses.childpidfds && svr_ses.orphanpids > 0) {
+		/* Children whose channel closed before they exited have no pidfd
+		 * left. Collect them as they finish so they don't linger. */
+		unsigned int i;
+		for (i = 0; i < svr_ses.childpidsize; i++) {
+			if (svr_ses.childpids[i].pid > 0
+					&& svr_ses.childpids[i].chansess == NULL
+					&& waitpid(svr_ses.childpids[i].pid, &status, WNOHANG) != 0) {
+				TRACE(("reaped orphan pid %d", svr_ses.childpids[i].pid))
+				svr_ses.childpids[i].pid = -1;
+				svr_ses.orphanpids--;
+			}
+		}
+	}
+#endif
+
 	if (!ses.channel_signal_pending) {
 		return;
 	}
@@ -103,6 +156,7 @@ void svr_chansess_checksignal(void) {
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
 		unsigned int i;
 		struct exitinfo *ex = NULL;
+		struct exitinfo orphan;
 		TRACE(("svr_chansess_checksignal : pid %d", pid))
 
 		ex = NULL;
@@ -110,7 +164,14 @@ void svr_chansess_checksignal(void) {
 		for (i = 0; i < svr_ses.childpidsize; i++) {
 			if (svr_ses.childpids[i].pid == pid) {
 				TRACE(("found match session"));
-				ex = &svr_ses.childpids[i].chansess->exit;
+				if (svr_ses.childpids[i].chansess) {
+					ex = &svr_ses.childpids[i].chansess->exit;
+				} else {
+					/* the channel has already gone */
+					svr_ses.childpids[i].pid = -1;
+					svr_ses.orphanpids--;
+					ex = &orphan;
+				}
 				break;
 			}
 		}
@@ -122,21 +183,26 @@ void svr_chansess_checksignal(void) {
 			ex = &svr_ses.lastexit;
 		}
 
-		ex->exitpid = pid;
-		if (WIFEXITED(status)) {
-			ex->exitstatus = WEXITSTATUS(status);
-		}
-		if (WIFSIGNALED(status)) {
-			ex->exitsignal = WTERMSIG(status);
+		fill_exitinfo(ex, pid, status);
+	}
+}
+
+/* Store a waitpid() status for return to the client */
+static void fill_exitinfo(struct exitinfo *ex, pid_t pid, int status) {
+	ex->exitpid = pid;
+	if (WIFEXITED(status)) {
+		ex->exitstatus = WEXITSTATUS(status);
+	}
+	if (WIFSIGNALED(status)) {
+		ex->exitsignal = WTERMSIG(status);
 #if !defined(AIX) && defined(WCOREDUMP)
-			ex->exitcore = WCOREDUMP(status);
+		ex->exitcore = WCOREDUMP(status);
 #else
-			ex->exitcore = 0;
+		ex->exitcore = 0;
 #endif
-		} else {
-			/* we use this to determine how pid exited */
-			ex->exitsignal = -1;
-		}
+	} else {
+		/* we use this to determine how pid exited */
+		ex->exitsignal = -1;
 	}
 }
 
@@ -256,6 +322,7 @@ static int newchansess(struct Channel *channel) {
 	chansess->term = NULL;
 
 	chansess->exit.exitpid = -1;
+	chansess->pidfd = -1;
 
 	channel->typedata = chansess;
 
@@ -341,13 +408,22 @@ static void cleanupchansess(const struct Channel *channel) {
 	svr_agentcleanup(chansess);
 #endif
 
+	if (chansess->pidfd >= 0) {
+		m_close(chansess->pidfd);
+	}
+
 	/* clear child pid entries */
 	for (i = 0; i < svr_ses.childpidsize; i++) {
 		if (svr_ses.childpids[i].chansess == chansess) {
 			dropbear_assert(svr_ses.childpids[i].pid > 0);
 			TRACE(("closing pid %d", svr_ses.childpids[i].pid))
 			TRACE(("exitpid is %d", chansess->exit.exitpid))
-			svr_ses.childpids[i].pid = -1;
+			if (svr_ses.childpidfds && chansess->exit.exitpid == -1) {
+				/* still running, without SIGCHLD nothing else will reap it */
+				svr_ses.orphanpids++;
+			} else {
+				svr_ses.childpids[i].pid = -1;
+			}
 			svr_ses.childpids[i].chansess = NULL;
 		}
 	}
@@ -578,7 +654,7 @@ static int sessionpty(struct ChanSess * chansess) {
 
 	unsigned int termlen;
 	char namebuf[65];
-	struct passwd * pw = NULL;
+	struct passwd pw;
 
 	TRACE(("enter sessionpty"))
 
@@ -608,10 +684,14 @@ static int sessionpty(struct ChanSess * chansess) {
 		dropbear_exit("Out of memory"); /* TODO disconnect */
 	}
 
-	pw = getpwnam(ses.authstate.pw_name);
-	if (!pw)
-		dropbear_exit("getpwnam failed after succeeding previously");
-	pty_setowner(pw, chansess->tty);
+	/* the account was looked up during auth */
+	memset(&pw, 0x0, sizeof(pw));
+	pw.pw_name = ses.authstate.pw_name;
+	pw.pw_uid = ses.authstate.pw_uid;
+	pw.pw_gid = ses.authstate.pw_gid;
+	pw.pw_dir = ses.authstate.pw_dir;
+	pw.pw_shell = ses.authstate.pw_shell;
+	pty_setowner(&pw, chansess->tty);
 
 	/* Set up the rows/col counts */
 	sessionwinchange(chansess);
@@ -771,23 +851,7 @@ static int noptycommand(struct Channel *channel, struct ChanSess *chansess) {
 	ses.maxfd = MAX(ses.maxfd, channel->errfd);
 	channel->bidir_fd = 0;
 
-	addchildpid(chansess, chansess->pid);
-
-	if (svr_ses.lastexit.exitpid != -1) {
-		unsigned int i;
-		TRACE(("parent side: lastexitpid is %d", svr_ses.lastexit.exitpid))
-		/* The child probably exited and the signal handler triggered
-		 * possibly before we got around to adding the childpid. So we fill
-		 * out its data manually */
-		for (i = 0; i < svr_ses.childpidsize; i++) {
-			if (svr_ses.childpids[i].pid == svr_ses.lastexit.exitpid) {
-				TRACE(("found match for lastexitpid"))
-				svr_ses.childpids[i].chansess->exit = svr_ses.lastexit;
-				svr_ses.lastexit.exitpid = -1;
-				break;
-			}
-		}
-	}
+	watchchild(channel, chansess);
 
 	TRACE(("leave noptycommand"))
 	return DROPBEAR_SUCCESS;
@@ -847,6 +911,9 @@ static int ptycommand(struct Channel *channel, struct ChanSess *chansess) {
 		 * terminal used for stdout with the dup2 above, otherwise
 		 * the wtmp login will not be recorded */
 		li = chansess_login_alloc(chansess);
+		/* chansess->pid is only set in the parent. login(3) fills it in
+		 * itself, the other record writers need it here */
+		li->pid = getpid();
 		login_login(li);
 		login_free_entry(li);
 
@@ -902,7 +969,7 @@ static int ptycommand(struct Channel *channel, struct ChanSess *chansess) {
 		chansess->pid = pid;
 
 		/* add a child pid */
-		addchildpid(chansess, pid);
+		watchchild(channel, chansess);
 
 		close(chansess->slave);
 		channel->writefd = chansess->master;
@@ -919,6 +986,64 @@ static int ptycommand(struct Channel *channel, struct ChanSess *chansess) {
 	return DROPBEAR_SUCCESS;
 }
 
+#if DROPBEAR_CHILD_PIDFD
+/* Returns a descriptor that becomes readable once pid exits, or -1 */
+static int open_child_pidfd(pid_t pid) {
+#ifdef HAVE_PIDFD_OPEN
+	return pidfd_open(pid, 0);
+#else
+	/* Old libc - kernel might support it but not the library */
+	return syscall(SYS_pidfd_open, pid, 0);
+#endif
+}
+#endif
+
+/* Set up exit-handling for a newly started chansess->pid. With pidfds the
+ * exit only wakes this channel, otherwise SIGCHLD reaps all children and
+ * every channel is checked. */
+static void watchchild(struct Channel *channel, struct ChanSess *chansess) {
+
+	/* also kept with pidfds, in case we have to fall back to SIGCHLD */
+	addchildpid(chansess, chansess->pid);
+
+#if DROPBEAR_CHILD_PIDFD
+	if (svr_ses.childpidfds) {
+		/* The child can't have been reaped yet, so this works even if
+		 * it has already exited */
+		chansess->pidfd = open_child_pidfd(chansess->pid);
+		if (chansess->pidfd >= 0) {
+			channel->exitfd = chansess->pidfd;
+			ses.maxfd = MAX(ses.maxfd, chansess->pidfd);
+			return;
+		}
+		/* Out of descriptors most likely. SIGCHLD handles the rest of
+		 * the session, the handler wakes the main loop to catch up on
+		 * anything that has exited already */
+		dropbear_log(LOG_WARNING, "pidfd_open failed, using SIGCHLD: %s",
+				strerror(errno));
+		svr_ses.childpidfds = 0;
+		sesssigchild_handler(0);
+		return;
+	}
+#endif
+
+	if (svr_ses.lastexit.exitpid != -1) {
+		unsigned int i;
+		TRACE(("parent side: lastexitpid is %d", svr_ses.lastexit.exitpid))
+		/* The child probably exited and the signal handler triggered
+		 * possibly before we got around to adding the childpid. So we fill
+		 * out its data manually */
+		for (i = 0; i < svr_ses.childpidsize; i++) {
+			if (svr_ses.childpids[i].pid == svr_ses.lastexit.exitpid) {
+				TRACE(("found match for lastexitpid"))
+				svr_ses.childpids[i].chansess->exit = svr_ses.lastexit;
+				svr_ses.lastexit.exitpid = -1;
+				break;
+			}
+		}
+	}
+}
+
 /* Add the pid of a child to the list for exit-handling */
 static void addchildpid(struct ChanSess *chansess, pid_t pid) {
 
@@ -984,9 +1109,17 @@ static void execchild(const void *user_data) {
 	/* We can only change uid/gid as root ... */
 	if (getuid() == 0) {
 
-		if ((setgid(ses.authstate.pw_gid) < 0) ||
-			(initgroups(ses.authstate.pw_name, 
-						ses.authstate.pw_gid) < 0)) {
+		if (setgid(ses.authstate.pw_gid) < 0) {
+			dropbear_exit("Error changing user group");
+		}
+		/* reuse the group list from auth if there is one */
+		if (ses.authstate.pw_groups) {
+			if (setgroups(ses.authstate.pw_ngroups,
+						ses.authstate.pw_groups) < 0) {
+				dropbear_exit("Error changing user group");
+			}
+		} else if (initgroups(ses.authstate.pw_name,
+					ses.authstate.pw_gid) < 0) {
 			dropbear_exit("Error changing user group");
 		}
 		if (setuid(ses.authstate.pw_uid) < 0) {
@@ -1065,7 +1198,11 @@ static void execchild(const void *user_data) {
 #endif
 
 	usershell = m_strdup(get_user_shell());
+#if DROPBEAR_SVR_DIRECT_EXEC
+	run_direct_command(chansess->cmd, ses.maxfd, usershell);
+#else
 	run_shell_command(chansess->cmd, ses.maxfd, usershell);
+#endif
 
 	/* only reached on error */
 	dropbear_exit("Child failed");
@@ -1083,7 +1220,30 @@ void svr_chansessinitialise() {
 	svr_ses.childpids[0].chansess = NULL;
 	svr_ses.childpidsize = 1;
 	svr_ses.lastexit.exitpid = -1; /* Nothing has exited yet */
-	sa_chld.sa_handler = sesssigchild_handler;
+	svr_ses.orphanpids = 0;
+
+	/* Prefer a pidfd per child when the kernel has them, so that an exit
+	 * doesn't need a SIGCHLD to check every channel */
+	svr_ses.childpidfds = 0;
+#if DROPBEAR_CHILD_PIDFD
+#if DROPBEAR_FUZZ
+	if (!fuzz.fuzzing)
+#endif
+	{
+		int fd = open_child_pidfd(getpid());
+		if (fd >= 0) {
+			m_close(fd);
+			svr_ses.childpidfds = 1;
+		}
+	}
+#endif
+
+	if (svr_ses.childpidfds) {
+		/* Children must stay unreaped until their pidfd is handled */
+		sa_chld.sa_handler = SIG_DFL;
+	} else {
+		sa_chld.sa_handler = sesssigchild_handler;
+	}
 	sa_chld.sa_flags = SA_NOCLDSTOP;
 	sigemptyset(&sa_chld.sa_mask);
 	if (sigaction(SIGCHLD, &sa_chld, NULL) < 0) {
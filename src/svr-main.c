@@ -30,8 +30,13 @@
 #include "runopts.h"
 #include "dbrandom.h"
 #include "crypto_desc.h"
+#include "pwcache.h"
+#include "loginrec.h"
 
 static size_t listensockets(int *sock, size_t sockcount, int *maxfd);
+#if DROPBEAR_SVR_LOGINREC_WRITER
+static void start_login_writer(const int *listensocks, size_t listensockcount);
+#endif
 static void sigchld_handler(int dummy);
 static void sigsegv_handler(int);
 static void sigintterm_handler(int fish);
@@ -204,6 +209,10 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 		fclose(pidfile);
 	}
 
+#if DROPBEAR_SVR_LOGINREC_WRITER
+	start_login_writer(listensocks, listensockcount);
+#endif
+
 	/* incoming connection select loop */
 	for(;;) {
 
@@ -241,10 +250,11 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 			dropbear_exit("Listening socket error");
 		}
 
-		/* close fds which have been authed or closed - svr-auth.c handles
-		 * closing the auth sockets on success */
+		/* answer user lookups, and close fds which have been authed or
+		 * closed - svr-auth.c handles closing the auth sockets on success */
 		for (i = 0; i < MAX_UNAUTH_CLIENTS; i++) {
-			if (childpipes[i] >= 0 && FD_ISSET(childpipes[i], &fds)) {
+			if (childpipes[i] >= 0 && FD_ISSET(childpipes[i], &fds)
+					&& svr_pwcache_reply(childpipes[i]) == DROPBEAR_FAILURE) {
 				m_close(childpipes[i]);
 				childpipes[i] = -1;
 				m_free(preauth_addrs[i]);
@@ -297,7 +307,8 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 
 			seedrandom();
 
-			if (pipe(childpipe) < 0) {
+			/* Bidirectional, the child asks for user lookups over it */
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, childpipe) < 0) {
 				TRACE(("error creating child pipe"))
 				goto out;
 			}
@@ -318,6 +329,7 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 
 				/* parent */
 				childpipes[conn_idx] = childpipe[0];
+				setnonblocking(childpipe[0]);
 				m_close(childpipe[1]);
 				preauth_addrs[conn_idx] = remote_host;
 				remote_host = NULL;
@@ -346,9 +358,12 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 				if (execfd >= 0) {
 #if DROPBEAR_DO_REEXEC
 					/* Add "-2 childpipe[1]" to the args and re-execute ourself. */
-					char **new_argv = m_malloc(sizeof(char*) * (argc+4));
+					char **new_argv = m_malloc(sizeof(char*) * (argc+6));
 					char buf[10];
 					int pos0 = 0, new_argc = argc+2;
+#if DROPBEAR_SVR_LOGINREC_WRITER
+					char loginbuf[10];
+#endif
 
 					/* We need to specially handle "dropbearmulti dropbear". */
 					if (multipath) {
@@ -361,6 +376,15 @@ static void main_noinetd(int argc, char ** argv, const char* multipath) {
 					new_argv[new_argc-2] = "-2";
 					snprintf(buf, sizeof(buf), "%d", childpipe[1]);
 					new_argv[new_argc-1] = buf;
+#if DROPBEAR_SVR_LOGINREC_WRITER
+					/* and "-3 login_writer_fd" */
+					if (login_writer_fd >= 0) {
+						new_argc += 2;
+						new_argv[new_argc-2] = "-3";
+						snprintf(loginbuf, sizeof(loginbuf), "%d", login_writer_fd);
+						new_argv[new_argc-1] = loginbuf;
+					}
+#endif
 					new_argv[new_argc] = NULL;
 
 					if ((dup2(childsock, STDIN_FILENO) < 0)) {
@@ -401,6 +425,49 @@ out:
 #endif /* NON_INETD_MODE */
 
 
+#if DROPBEAR_SVR_LOGINREC_WRITER
+/* Fork the process that writes login records for every session. Sessions
+ * inherit the socket to it, which stays open after the listener exits so
+ * that logouts are still recorded */
+static void start_login_writer(const int *listensocks, size_t listensockcount) {
+	int fds[2];
+	pid_t pid;
+	size_t i;
+
+	if (geteuid() != 0) {
+		/* login_write() won't record anything */
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+		dropbear_log(LOG_WARNING, "Couldn't start login record writer: %s",
+				strerror(errno));
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		dropbear_log(LOG_WARNING, "Couldn't start login record writer: %s",
+				strerror(errno));
+		m_close(fds[0]);
+		m_close(fds[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		for (i = 0; i < listensockcount; i++) {
+			m_close(listensocks[i]);
+		}
+		m_close(fds[1]);
+		login_writer(fds[0]);
+		/* not reached */
+	}
+
+	m_close(fds[0]);
+	login_writer_fd = fds[1];
+}
+#endif /* DROPBEAR_SVR_LOGINREC_WRITER */
+
 /* catch + reap zombie children */
 static void sigchld_handler(int UNUSED(unused)) {
 	struct sigaction sa_chld;
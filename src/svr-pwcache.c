@@ -0,0 +1,248 @@
+#include "includes.h"
+#include "dbutil.h"
+#include "buffer.h"
+#include "session.h"
+#include "auth.h"
+#include "atomicio.h"
+#include "pwcache.h"
+
+/* How many users the listener remembers */
+#define PWCACHE_ENTRIES 16
+/* Larger group lists aren't cached, the session falls back to initgroups() */
+#define PWCACHE_MAX_GROUPS 1024
+/* Upper bound for an answer, a session won't read anything larger */
+#define PWCACHE_MAX_ANSWER (4096 + 4*PWCACHE_MAX_GROUPS)
+
+struct pwcache_entry {
+	char *name;
+	time_t expiry;
+	buffer *answer;
+};
+
+static struct pwcache_entry pwcache[PWCACHE_ENTRIES];
+
+/* Looks up username with NSS. The answer is serialised as
+ *   bool     found, nothing else follows if false
+ *   string   pw_name
+ *   string   pw_passwd
+ *   uint32   pw_uid
+ *   uint32   pw_gid
+ *   string   pw_dir
+ *   string   pw_shell
+ *   uint32   number of supplementary groups, 0 if not known
+ *   uint32   gid, repeated
+ */
+static buffer* pwcache_resolve(const char *username) {
+	struct passwd *pw = NULL;
+	const char *passwd_crypt = NULL;
+	buffer *answer = NULL;
+	gid_t *groups = NULL;
+	int ngroups = 0, i;
+
+	answer = buf_new(1);
+	pw = getpwnam(username);
+	if (!pw) {
+		buf_putbyte(answer, 0);
+		return answer;
+	}
+
+	/* android supposedly returns NULL */
+	passwd_crypt = pw->pw_passwd ? pw->pw_passwd : "!!";
+
+	answer = buf_resize(answer, 1 + 4*4 + strlen(pw->pw_name)
+		+ strlen(passwd_crypt) + strlen(pw->pw_dir) + strlen(pw->pw_shell)
+		+ 4 + 4*PWCACHE_MAX_GROUPS);
+	buf_putbyte(answer, 1);
+	buf_putstring(answer, pw->pw_name, strlen(pw->pw_name));
+	buf_putstring(answer, passwd_crypt, strlen(passwd_crypt));
+	buf_putint(answer, pw->pw_uid);
+	buf_putint(answer, pw->pw_gid);
+	buf_putstring(answer, pw->pw_dir, strlen(pw->pw_dir));
+	buf_putstring(answer, pw->pw_shell, strlen(pw->pw_shell));
+
+#ifdef HAVE_GETGROUPLIST
+	groups = m_malloc(sizeof(gid_t) * PWCACHE_MAX_GROUPS);
+	ngroups = PWCACHE_MAX_GROUPS;
+	if (getgrouplist(pw->pw_name, pw->pw_gid, groups, &ngroups) < 0) {
+		TRACE(("getgrouplist for %s needs %d groups", pw->pw_name, ngroups))
+		ngroups = 0;
+	}
+#endif
+	buf_putint(answer, ngroups);
+	for (i = 0; i < ngroups; i++) {
+		buf_putint(answer, groups[i]);
+	}
+	m_free(groups);
+
+	return answer;
+}
+
+/* Sets ses.authstate from a pwcache_resolve() answer */
+static void pwcache_apply(buffer *answer) {
+	struct passwd pw;
+	unsigned int ngroups, i;
+
+	m_free(ses.authstate.pw_groups);
+	ses.authstate.pw_ngroups = 0;
+
+	buf_setpos(answer, 0);
+	if (!buf_getbool(answer)) {
+		fill_passwd_entry(NULL);
+		return;
+	}
+
+	memset(&pw, 0x0, sizeof(pw));
+	pw.pw_name = buf_getstring(answer, NULL);
+	pw.pw_passwd = buf_getstring(answer, NULL);
+	pw.pw_uid = buf_getint(answer);
+	pw.pw_gid = buf_getint(answer);
+	pw.pw_dir = buf_getstring(answer, NULL);
+	pw.pw_shell = buf_getstring(answer, NULL);
+	fill_passwd_entry(&pw);
+	m_free(pw.pw_name);
+	m_free(pw.pw_passwd);
+	m_free(pw.pw_dir);
+	m_free(pw.pw_shell);
+
+	ngroups = buf_getint(answer);
+	if (ngroups > 0 && ngroups <= PWCACHE_MAX_GROUPS) {
+		ses.authstate.pw_groups = m_malloc(sizeof(gid_t) * ngroups);
+		for (i = 0; i < ngroups; i++) {
+			ses.authstate.pw_groups[i] = buf_getint(answer);
+		}
+		ses.authstate.pw_ngroups = ngroups;
+	}
+}
+
+int svr_pwcache_reply(int childpipe) {
+	buffer *req = NULL, *reply = NULL;
+	struct pwcache_entry *entry = NULL;
+	char *username = NULL;
+	unsigned int namelen, i;
+	time_t now;
+	ssize_t len;
+	int ret = DROPBEAR_FAILURE;
+
+	/* A request is a single uint32-prefixed username, written at once */
+	req = buf_new(4 + MAX_USERNAME_LEN);
+	len = read(childpipe, req->data, req->size);
+	if (len < 4) {
+		/* closed, or not a request */
+		goto out;
+	}
+	buf_setlen(req, len);
+	namelen = buf_getint(req);
+	if (namelen != req->len - 4) {
+		goto out;
+	}
+	username = m_malloc(namelen + 1);
+	memcpy(username, buf_getptr(req, namelen), namelen);
+	if (strlen(username) != namelen) {
+		goto out;
+	}
+
+	now = monotonic_now();
+	for (i = 0; i < PWCACHE_ENTRIES; i++) {
+		if (pwcache[i].name && strcmp(pwcache[i].name, username) == 0) {
+			entry = &pwcache[i];
+			break;
+		}
+	}
+
+	if (entry == NULL) {
+		/* take a free slot, or the one closest to expiring */
+		entry = &pwcache[0];
+		for (i = 0; i < PWCACHE_ENTRIES; i++) {
+			if (!pwcache[i].name) {
+				entry = &pwcache[i];
+				break;
+			}
+			if (pwcache[i].expiry < entry->expiry) {
+				entry = &pwcache[i];
+			}
+		}
+		m_free(entry->name);
+		entry->name = m_strdup(username);
+		entry->expiry = now;
+	}
+
+	if (entry->expiry <= now) {
+		TRACE(("pwcache: resolving %s", username))
+		if (entry->answer) {
+			buf_free(entry->answer);
+		}
+		entry->answer = pwcache_resolve(username);
+		entry->expiry = now + DROPBEAR_SVR_PWCACHE_TTL;
+	}
+
+	reply = buf_new(4 + entry->answer->len);
+	buf_putint(reply, entry->answer->len);
+	buf_putbytes(reply, entry->answer->data, entry->answer->len);
+
+	/* The session is waiting for this, a short write (on the nonblocking
+	 * socket) would mean something has gone wrong */
+	if (write(childpipe, reply->data, reply->len) == (ssize_t)reply->len) {
+		ret = DROPBEAR_SUCCESS;
+	}
+
+out:
+	buf_free(req);
+	if (reply) {
+		buf_free(reply);
+	}
+	m_free(username);
+	return ret;
+}
+
+#if DROPBEAR_SVR_PWCACHE_TTL > 0
+/* Asks the listener for an answer, NULL if it couldn't give one */
+static buffer* pwcache_request(const char *username) {
+	buffer *req = NULL, *answer = NULL;
+	unsigned char lenbuf[4];
+	unsigned int len;
+
+	len = strlen(username);
+	if (len > MAX_USERNAME_LEN) {
+		return NULL;
+	}
+
+	req = buf_new(4 + len);
+	buf_putstring(req, username, len);
+	if (atomicio(vwrite, svr_ses.childpipe, req->data, req->len) != req->len
+			|| atomicio(read, svr_ses.childpipe, lenbuf, 4) != 4) {
+		TRACE(("pwcache request failed: %s", strerror(errno)))
+		goto out;
+	}
+
+	LOAD32H(len, lenbuf);
+	if (len == 0 || len > PWCACHE_MAX_ANSWER) {
+		goto out;
+	}
+	answer = buf_new(len);
+	if (atomicio(read, svr_ses.childpipe, answer->data, len) != len) {
+		buf_free(answer);
+		answer = NULL;
+		goto out;
+	}
+	buf_setlen(answer, len);
+
+out:
+	buf_free(req);
+	return answer;
+}
+#endif
+
+void svr_fill_passwd(const char *username) {
+	buffer *answer = NULL;
+
+#if DROPBEAR_SVR_PWCACHE_TTL > 0
+	if (svr_ses.childpipe >= 0) {
+		answer = pwcache_request(username);
+	}
+#endif
+	if (answer == NULL) {
+		answer = pwcache_resolve(username);
+	}
+	pwcache_apply(answer);
+	buf_free(answer);
+}
@@ -29,6 +29,7 @@
 #include "dbutil.h"
 #include "algo.h"
 #include "ecdsa.h"
+#include "loginrec.h"
 
 #include <grp.h>
 
@@ -146,6 +147,9 @@ void svr_getopts(int argc, char ** argv) {
 	char* idle_timeout_arg = NULL;
 	char* maxauthtries_arg = NULL;
 	char* reexec_fd_arg = NULL;
+#if DROPBEAR_SVR_LOGINREC_WRITER
+	char* login_writer_arg = NULL;
+#endif
 	char* keyfile = NULL;
 	char c;
 #if DROPBEAR_PLUGIN
@@ -263,6 +267,11 @@ void svr_getopts(int argc, char ** argv) {
 				case '2':
 					next = &reexec_fd_arg;
 					break;
+#if DROPBEAR_SVR_LOGINREC_WRITER
+				case '3':
+					next = &login_writer_arg;
+					break;
+#endif
 #endif
 				case 'p':
 					nextisport = 1;
@@ -443,6 +452,16 @@ void svr_getopts(int argc, char ** argv) {
 		}
 	}
 
+#if DROPBEAR_SVR_LOGINREC_WRITER
+	if (login_writer_arg) {
+		unsigned int fd;
+		if (m_str_to_uint(login_writer_arg, &fd) == DROPBEAR_FAILURE) {
+			dropbear_exit("Bad -3");
+		}
+		login_writer_fd = fd;
+	}
+#endif
+
 	if (svr_opts.multiauthmethod && svr_opts.noauthpass) {
 		dropbear_exit("-t and -s are incompatible");
 	}
@@ -41,6 +41,7 @@
 #include "runopts.h"
 #include "crypto_desc.h"
 #include "fuzz.h"
+#include "resolve.h"
 
 static void svr_remoteclosed(void);
 static void svr_algos_initialise(void);
@@ -105,6 +106,32 @@ svr_session_cleanup(void) {
 #endif
 }
 
+#if DO_HOST_LOOKUP
+static void svr_remotehost_resolved(const char *host, void *UNUSED(data)) {
+	if (host) {
+		TRACE(("remote host is %s", host))
+		m_free(svr_ses.remotehost);
+		svr_ses.remotehost = m_strdup(host);
+	}
+}
+
+/* svr_ses.remotehost starts off as the address, the name replaces it
+ * if the lookup finishes in time */
+static void svr_start_host_lookup(void) {
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+
+#if DROPBEAR_FUZZ
+	if (fuzz.fuzzing) {
+		return;
+	}
+#endif
+	if (getpeername(ses.sock_in, (struct sockaddr*)&addr, &addrlen) == 0) {
+		resolve_name(&addr, addrlen, svr_remotehost_resolved, NULL);
+	}
+}
+#endif
+
 void svr_session(int sock, int childpipe) {
 	char *host, *port;
 	size_t len;
@@ -176,7 +203,10 @@ void svr_session(int sock, int childpipe) {
 	svr_algos_initialise();
 
 	get_socket_address(ses.sock_in, NULL, NULL, 
-			&svr_ses.remotehost, NULL, 1);
+			&svr_ses.remotehost, NULL, 0);
+#if DO_HOST_LOOKUP
+	svr_start_host_lookup();
+#endif
 
 	/* set up messages etc */
 	ses.remoteclosed = svr_remoteclosed;
@@ -276,10 +276,18 @@
 #define DROPBEAR_LISTENERS \
    ((DROPBEAR_CLI_REMOTETCPFWD) || (DROPBEAR_CLI_LOCALTCPFWD) || \
 	(DROPBEAR_SVR_REMOTETCPFWD) || (DROPBEAR_SVR_LOCALANYFWD) || \
-	(DROPBEAR_SVR_AGENTFWD) || (DROPBEAR_X11FWD))
+	(DROPBEAR_SVR_AGENTFWD) || (DROPBEAR_X11FWD) || (DROPBEAR_CLI_MUX))
 
 #define DROPBEAR_CLI_MULTIHOP ((DROPBEAR_CLI_NETCAT) && (DROPBEAR_CLI_PROXYCMD))
 
+/* Pubkey queries in flight at once, replies to pipelined requests
+ * are only handled alongside immediate auth */
+#if DROPBEAR_CLI_IMMEDIATE_AUTH
+#define CLI_PUBKEY_PIPELINE (DROPBEAR_CLI_PUBKEY_PIPELINE)
+#else
+#define CLI_PUBKEY_PIPELINE 1
+#endif
+
 #define ENABLE_CONNECT_UNIX ((DROPBEAR_CLI_AGENTFWD) || (DROPBEAR_USE_PRNGD))
 
 /* if we're using authorized_keys or known_hosts */ 
@@ -289,6 +297,10 @@
  * with flushing compressed data */
 #define DROPBEAR_ZLIB_MEM_LEVEL 8
 
+#if CLI_PUBKEY_PIPELINE < 1
+#error "DROPBEAR_CLI_PUBKEY_PIPELINE must be at least 1"
+#endif
+
 #if (DROPBEAR_SVR_PASSWORD_AUTH) && (DROPBEAR_SVR_PAM_AUTH)
 #error "You can't turn on PASSWORD and PAM auth both at once. Fix it in localoptions.h"
 #endif
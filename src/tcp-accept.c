@@ -35,6 +35,10 @@
 
 #if DROPBEAR_TCP_ACCEPT
 
+/* Connections taken from a listening socket per wakeup. Any more wait for
+ * the next pass, so other channels keep moving. */
+#define TCP_ACCEPT_BATCH 64
+
 static void cleanup_tcp(const struct Listener *listener) {
 
 	struct TCPListener *tcpinfo = (struct TCPListener*)(listener->typedata);
@@ -45,28 +49,37 @@ static void cleanup_tcp(const struct Listener *listener) {
 	m_free(tcpinfo);
 }
 
-static void tcp_acceptor(const struct Listener *listener, int sock) {
-
+/* Accepts a pending connection. send_msg_channel_open_init() makes it
+ * non-blocking where accept4() isn't available. */
+static int tcp_accept_one(int sock, struct sockaddr_storage *sa, socklen_t *len) {
+#ifdef HAVE_ACCEPT4
 	int fd;
-	struct sockaddr_storage sa;
-	socklen_t len;
-	char ipstring[NI_MAXHOST], portstring[NI_MAXSERV];
-	struct TCPListener *tcpinfo = (struct TCPListener*)(listener->typedata);
 
-	len = sizeof(sa);
-
-	fd = accept(sock, (struct sockaddr*)&sa, &len);
-	if (fd < 0) {
-		return;
+	fd = accept4(sock, (struct sockaddr*)sa, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd >= 0 || errno != ENOSYS) {
+		return fd;
 	}
+#endif
+	return accept(sock, (struct sockaddr*)sa, len);
+}
 
-	if (getnameinfo((struct sockaddr*)&sa, len, ipstring, sizeof(ipstring),
+/* Returns DROPBEAR_FAILURE if no more channels can be opened */
+static int tcp_open_channel(const struct TCPListener *tcpinfo, int fd,
+		const struct sockaddr_storage *sa, socklen_t len) {
+
+	char ipstring[NI_MAXHOST], portstring[NI_MAXSERV];
+
+	if (getnameinfo((const struct sockaddr*)sa, len, ipstring, sizeof(ipstring),
 				portstring, sizeof(portstring), 
 				NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
 		m_close(fd);
-		return;
+		return DROPBEAR_SUCCESS;
 	}
 
+	/* fd isn't read until the open is confirmed. Anything the connecting
+	 * client sends meanwhile waits in the socket buffer and goes out as soon
+	 * as the channel has a window, reading it ahead wouldn't save a round
+	 * trip - SSH has no way to send data before the confirmation. */
 	if (send_msg_channel_open_init(fd, tcpinfo->chantype) == DROPBEAR_SUCCESS) {
 		char* addr = NULL;
 		unsigned int port = 0;
@@ -96,18 +109,46 @@ static void tcp_acceptor(const struct Listener *listener, int sock) {
 		buf_putint(ses.writepayload, atol(portstring));
 
 		encrypt_packet();
+		return DROPBEAR_SUCCESS;
 
 	} else {
 		/* XXX debug? */
 		close(fd);
+		return DROPBEAR_FAILURE;
 	}
 }
 
+/* Takes everything waiting on the (non-blocking) listening socket, up to
+ * TCP_ACCEPT_BATCH, so a burst of clients doesn't need a trip around the
+ * main loop for each connection. The channel opens go out back-to-back. */
+static void tcp_acceptor(const struct Listener *listener, int sock) {
+
+	int fd;
+	unsigned int i;
+	struct sockaddr_storage sa;
+	socklen_t len;
+	struct TCPListener *tcpinfo = (struct TCPListener*)(listener->typedata);
+
+	for (i = 0; i < TCP_ACCEPT_BATCH; i++) {
+		len = sizeof(sa);
+		fd = tcp_accept_one(sock, &sa, &len);
+		if (fd < 0) {
+			/* EAGAIN once there are no more */
+			break;
+		}
+		if (tcp_open_channel(tcpinfo, fd, &sa, len) == DROPBEAR_FAILURE) {
+			/* the rest can wait in the backlog */
+			break;
+		}
+	}
+	TRACE(("tcp_acceptor: %u accepted", i))
+}
+
 int listen_tcpfwd(struct TCPListener* tcpinfo, struct Listener **ret_listener) {
 
 	char portstring[NI_MAXSERV];
 	int socks[DROPBEAR_MAX_SOCKS];
-	int nsocks;
+	int nsocks, i;
 	struct Listener *listener;
 	char* errstring = NULL;
 
@@ -125,6 +166,11 @@ int listen_tcpfwd(struct TCPListener* tcpinfo, struct Listener **ret_listener) {
 		return DROPBEAR_FAILURE;
 	}
 	m_free(errstring);
+
+	/* tcp_acceptor() accepts until there's nothing left */
+	for (i = 0; i < nsocks; i++) {
+		setnonblocking(socks[i]);
+	}
 	
 	/* new_listener will close the socks if it fails */
 	listener = new_listener(socks, nsocks, CHANNEL_ID_TCPFORWARDED, tcpinfo, 
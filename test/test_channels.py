@@ -9,6 +9,18 @@ def test_exitcode(request, dropbear):
 	r = dbclient(request, "exit 44")
 	assert r.returncode == 44
 
+@pytest.mark.parametrize("cmd, out", [
+	("echo plain   words", "plain words"),
+	("echo $((6*7))", "42"),
+	("echo a; echo b", "a\nb"),
+	("false || echo ok", "ok"),
+	])
+def test_exec_command(request, dropbear, cmd, out):
+	# plain commands may be executed directly, others need the shell
+	r = dbclient(request, cmd, capture_output=True, text=True)
+	r.check_returncode()
+	assert r.stdout.rstrip() == out
+
 @pytest.mark.xfail(reason="Not yet implemented", strict=True)
 def test_signal(request, dropbear):
 	r = dbclient(request, "kill -FPE $$")
@@ -132,3 +144,36 @@ def test_tcpflushout(request, dropbear, size, fwd_flag):
 		# check has exited, allow time for dbclient to exit
 		time.sleep(0.1)
 		assert r.poll() == 0
+
+@pytest.mark.parametrize("fwd_flag", "LR")
+def test_tcpfwd_burst(request, dropbear, fwd_flag):
+	""" Many connections arriving at a forward at once are all accepted
+	and each gets its own channel
+	"""
+	opt = request.config.option
+	if opt.remote:
+		pytest.xfail("don't know address for remote")
+
+	class Echo(socketserver.StreamRequestHandler):
+		def handle(self):
+			self.wfile.write(self.rfile.readline())
+
+	N = 50
+	socketserver.ThreadingTCPServer.allow_reuse_address = True
+	with socketserver.ThreadingTCPServer(("localhost", 3345), Echo) as echo:
+		threading.Thread(target=echo.serve_forever, daemon=True).start()
+		r = dbclient(request, f"-{fwd_flag}", "7789:localhost:3345", "sleep 10",
+			background=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+		try:
+			# time to let the listener start
+			time.sleep(0.3)
+			conns = [socket.create_connection(("localhost", 7789)) for i in range(N)]
+			for i, c in enumerate(conns):
+				c.sendall(f"conn {i}\n".encode())
+			for i, c in enumerate(conns):
+				c.settimeout(10)
+				assert readall_socket(c) == f"conn {i}\n".encode()
+				c.close()
+		finally:
+			r.kill()
+			echo.shutdown()
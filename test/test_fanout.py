@@ -0,0 +1,26 @@
+from test_dropbear import *
+
+# Tests for running a command on many hosts with dbclient -H
+
+def test_fanout(request, dropbear, tmp_path):
+	opt = request.config.option
+	host = opt.remote or LOCALADDR
+	hosts = tmp_path / "hosts"
+	# the last one isn't listening
+	hosts.write_text(f"{host}\n# a comment\n\n{host}\n{host}\n127.0.5.9\n")
+
+	args = opt.dbclient.split() + ["-y", "-p", opt.port, "-H", str(hosts), "-P", "2"]
+	if opt.user:
+		args.extend(['-l', opt.user])
+	args.append("echo out; echo err >&2; printf partial; exit 3")
+	r = subprocess.run(args, capture_output=True, text=True, timeout=30)
+
+	# the highest status of any host
+	assert r.returncode == 3
+	out = r.stdout.splitlines()
+	assert out.count(f"{host}: out") == 3
+	assert out.count(f"{host}: partial") == 3
+	err = r.stderr.splitlines()
+	assert err.count(f"{host}: err") == 3
+	assert err.count(f"{host}: exit status 3") == 3
+	assert any(l.startswith("127.0.5.9: exit status ") for l in err)
@@ -0,0 +1,57 @@
+from test_dropbear import *
+import os
+import base64
+
+# Tests for dbclient's known_hosts handling, with a file large enough
+# to be indexed
+
+def filler_lines(n):
+	lines = []
+	for i in range(n):
+		blob = b"\0\0\0\x13ecdsa-sha2-nistp256" + os.urandom(60)
+		lines.append(f"filler{i}.example.net ecdsa-sha2-nistp256 {base64.b64encode(blob).decode()}\n")
+	return lines
+
+def test_known_hosts_index(request, dropbear, tmp_path):
+	if request.config.option.remote:
+		pytest.skip("needs a local server")
+	env = dict(os.environ, HOME=str(tmp_path))
+	kh = tmp_path / ".ssh" / "known_hosts"
+	idx = tmp_path / ".ssh" / "known_hosts.idx"
+
+	# learn the host key with an empty file
+	r = dbclient(request, "true", env=env, capture_output=True)
+	assert r.returncode == 0
+	ours = kh.read_text()
+	host, algo, key = ours.split()
+
+	# host key in the middle of a file large enough for an index
+	before = filler_lines(800)
+	after = filler_lines(800)
+	kh.write_text("".join(before) + ours + "".join(after))
+	size = kh.stat().st_size
+
+	for _ in range(2):
+		# built, then used as is
+		r = dbclient(request, "true", env=env, capture_output=True)
+		assert r.returncode == 0
+		assert idx.exists()
+		# found it, so nothing was appended
+		assert kh.stat().st_size == size
+
+	# a changed key is still caught after editing the file
+	wrong = base64.b64encode(b"\0\0\0\x13ecdsa-sha2-nistp256" + os.urandom(104)).decode()
+	kh.write_text("".join(before) + f"{host} {algo} {wrong}\n" + "x\n" + "".join(after))
+	r = dbclient(request, "true", env=env, capture_output=True)
+	assert r.returncode != 0
+	assert b"host key mismatch" in r.stderr
+
+	# without an entry it's appended, and found from the index next time
+	kh.write_text("".join(before) + "".join(after))
+	r = dbclient(request, "true", env=env, capture_output=True)
+	assert r.returncode == 0
+	size = kh.stat().st_size
+	assert kh.read_text().endswith(ours)
+	r = dbclient(request, "true", env=env, capture_output=True)
+	assert r.returncode == 0
+	assert kh.stat().st_size == size
@@ -0,0 +1,49 @@
+from test_dropbear import *
+import time
+
+# Tests for sharing a connection with -o ControlMaster/ControlPath
+
+def start_master(request, ctl, *args):
+	m = dbclient(request, "-N", "-o", "ControlMaster=yes", "-o", f"ControlPath={ctl}",
+		*args, background=True, stdin=subprocess.DEVNULL)
+	for _ in range(100):
+		if ctl.exists():
+			return m
+		time.sleep(0.1)
+	m.kill()
+	raise Exception("master didn't listen")
+
+def test_mux(request, dropbear, tmp_path):
+	ctl = tmp_path / "ctl"
+	m = start_master(request, ctl)
+	try:
+		# the proxy command would fail if a new connection was made
+		args = ("-J", "false", "-o", f"ControlPath={ctl}")
+		r = dbclient(request, *args, "cat; echo err >&2; exit 7",
+			input=b"through the master", capture_output=True)
+		assert r.returncode == 7
+		assert r.stdout == b"through the master"
+		assert r.stderr == b"err\n"
+
+		# several at once
+		procs = [dbclient(request, *args, f"sleep 0.5; echo {i}", background=True,
+			stdout=subprocess.PIPE) for i in range(5)]
+		for i, p in enumerate(procs):
+			out, _ = p.communicate(timeout=10)
+			assert p.returncode == 0
+			assert out == f"{i}\n".encode()
+	finally:
+		m.terminate()
+		m.wait(timeout=5)
+
+def test_mux_persist(request, dropbear, tmp_path):
+	ctl = tmp_path / "ctl"
+	m = start_master(request, ctl, "-o", "ControlPersist=1")
+	try:
+		r = dbclient(request, "-o", f"ControlPath={ctl}", "echo hi", capture_output=True)
+		assert r.stdout == b"hi\n"
+		# exits once idle, removing the socket
+		m.wait(timeout=5)
+		assert not ctl.exists()
+	finally:
+		m.kill()